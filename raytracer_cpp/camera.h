@@ -15,6 +15,12 @@ struct Camera
     float imageWidth; // Width/height of the view plane
     float imageHeight;
 
+    // Raster to world, worked out once: the (unnormalized) direction through raster (0, 0),
+    // and how far it moves per pixel across and down
+    vec3 rasterOrigin;
+    vec3 pixelDeltaX;
+    vec3 pixelDeltaY;
+
     Camera(const vec3 &cameraPosition, const vec3 &dir, float fov, int width, unsigned int height)
     {
         position = cameraPosition;
@@ -42,22 +48,28 @@ struct Camera
 
         // The half-width of the viewport, in world space
         halfAngle = float(tan(glm::radians(fov) / 2.0));
+
+        // The frustum mapping of GetWorldRay, folded into a corner and two steps
+        pixelDeltaX = right * (halfAngle * aspectRatio * 2.0f / imageWidth);
+        pixelDeltaY = -up * (halfAngle * 2.0f / imageHeight);
+        rasterOrigin = viewDirection - (right * (halfAngle * aspectRatio)) + (up * halfAngle);
     }
 
     // Given a screen coordinate, return a ray leaving the camera and entering the world at that 'pixel'
-    vec3 GetWorldRay(const vec2 &imageSample)
+    vec3 GetWorldRay(const vec2 &imageSample) const
+    {
+        return normalize(rasterOrigin + (pixelDeltaX * imageSample.x) + (pixelDeltaY * imageSample.y));
+    }
+
+    // The rays for count samples one pixel apart along a row, starting at imageSample.
+    // The row start is worked out once; each ray is then a single step from it and a normalize.  Stepping
+    // from the start, rather than from the previous ray, keeps rounding from building up along the row
+    void GetWorldRays(const vec2 &imageSample, int count, vec3 *pRays) const
     {
-        // Could move some of this maths out of here for speed, but this isn't time critical
-        vec3 dir(viewDirection);
-        float x = ((imageSample.x * 2.0f) / imageWidth) - 1.0f;
-        float y = ((imageSample.y * 2.0f) / imageHeight) - 1.0f;
-
-        // Take the view direction and adjust it to point at the given sample, based on the
-        // the frustum
-        dir += (right * (halfAngle * aspectRatio * x));
-        dir -= (up * (halfAngle * y));
-        dir = normalize(dir);
-
-        return dir;
+        vec3 rowStart = rasterOrigin + (pixelDeltaX * imageSample.x) + (pixelDeltaY * imageSample.y);
+        for (int i = 0; i < count; i++)
+        {
+            pRays[i] = normalize(rowStart + (pixelDeltaX * float(i)));
+        }
     }
 };
\ No newline at end of file
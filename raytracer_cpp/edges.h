@@ -0,0 +1,36 @@
+#pragma once
+
+// Geometric edge detection, for antialiasing only where it shows.
+// Each pixel's first camera ray records what it hit.  A pixel is on an edge when a neighbour sees a different
+// object or material, a surface turned away from its own, or something much nearer or further; only those
+// pixels take the rest of their samples.  Flat regions of a plane or the background are left at one sample.
+// Edges that only appear in reflections or shadows aren't found.
+
+// What a pixel's first camera ray hit
+struct PrimaryHit
+{
+    uint32_t primitiveId = NoPrimitive;
+    MaterialId material = 0;
+    vec3 normal = vec3(0.0f);
+    float distance = 0.0f;
+};
+
+// Neighbouring normals closer than this (the cosine of the angle between them) are the same surface
+const float EdgeNormalCosine = 0.9f;
+
+// Or their distances, relative to the nearer one
+const float EdgeDepthRatio = 0.05f;
+
+inline bool IsGeometricEdge(const PrimaryHit& a, const PrimaryHit& b)
+{
+    if (a.primitiveId != b.primitiveId || a.material != b.material)
+    {
+        return true;
+    }
+    if (a.primitiveId == NoPrimitive)
+    {
+        return false;
+    }
+    return glm::dot(a.normal, b.normal) < EdgeNormalCosine ||
+        std::abs(a.distance - b.distance) > EdgeDepthRatio * std::min(a.distance, b.distance);
+}
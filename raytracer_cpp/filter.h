@@ -0,0 +1,103 @@
+#pragma once
+
+#include <string>
+
+// Pixel reconstruction filters.
+// A pixel's samples are spread over the filter's footprint around the pixel center, and averaged with the
+// filter's weight at each.  Wider filters than the box trade a little sharpness for less aliasing.  The
+// filters are separable, and their 1D profile is tabulated once, so weighting a sample is two lookups.
+
+enum class FilterType
+{
+    Box,            // Flat over the pixel; a plain average
+    Tent,           // Linear falloff out to one pixel from the center
+    BlackmanHarris  // Smooth, nearly Gaussian falloff out to 1.5 pixels
+};
+
+struct FilterName
+{
+    FilterType type;
+    const char* pName;
+};
+
+// What the filters are called on the command line
+const FilterName FilterNames[] = {
+    { FilterType::Box, "box" },
+    { FilterType::Tent, "tent" },
+    { FilterType::BlackmanHarris, "blackmanharris" }
+};
+
+// Look up a filter by name.  Fails if there isn't one
+inline bool FindFilter(const std::string& name, FilterType& type)
+{
+    for (auto& entry : FilterNames)
+    {
+        if (name == entry.pName)
+        {
+            type = entry.type;
+            return true;
+        }
+    }
+    return false;
+}
+
+class PixelFilter
+{
+public:
+    explicit PixelFilter(FilterType type)
+    {
+        radius = type == FilterType::Box ? 0.5f : (type == FilterType::Tent ? 1.0f : 1.5f);
+
+        // Sampled at the middle of each step from the center out to the radius
+        for (int i = 0; i < TableSize; i++)
+        {
+            float x = (float(i) + 0.5f) / float(TableSize);
+            switch (type)
+            {
+            case FilterType::Box:
+                table[i] = 1.0f;
+                break;
+            case FilterType::Tent:
+                table[i] = 1.0f - x;
+                break;
+            case FilterType::BlackmanHarris:
+            {
+                // The window over [-radius, radius], evaluated at distance x * radius from its middle
+                float t = 0.5f + x * 0.5f;
+                const float pi2 = 2.0f * 3.14159265358979f;
+                table[i] = 0.35875f - 0.48829f * std::cos(pi2 * t) + 0.14128f * std::cos(2.0f * pi2 * t) - 0.01168f * std::cos(3.0f * pi2 * t);
+                break;
+            }
+            }
+        }
+    }
+
+    // How far from the pixel center samples go, in pixels
+    float Radius() const
+    {
+        return radius;
+    }
+
+    // Where a sample in [0, 1)^2 lands, relative to the pixel center
+    vec2 Offset(const vec2& sample) const
+    {
+        return (sample * 2.0f - vec2(1.0f)) * radius;
+    }
+
+    // The weight of a sample at an offset from the pixel center
+    float Weight(const vec2& offset) const
+    {
+        return Lookup(offset.x) * Lookup(offset.y);
+    }
+
+private:
+    float Lookup(float offset) const
+    {
+        int i = int(std::abs(offset) * (float(TableSize) / radius));
+        return i < TableSize ? table[i] : 0.0f;
+    }
+
+    static const int TableSize = 64;
+    float radius;
+    float table[TableSize];
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <string>
+
+// Render modes.
+// An integrator turns a camera ray into a color.  The renderers only ever call Trace, so the full lighting, a
+// quick look at the shapes or a debug view of the scene can be chosen from the command line.  Modes that don't
+// light the scene never visit the emitters or cast shadow rays for them.
+
+struct Integrator
+{
+    virtual ~Integrator() {}
+
+    // When pFirstHit is given, it is filled in with what the camera ray hit, so the renderer needn't trace it
+    // again to find out
+    virtual vec3 Trace(const vec3& rayorig, const vec3& raydir, HitRecord* pFirstHit) const = 0;
+};
+
+enum class IntegratorType
+{
+    Whitted,            // Direct light and mirror reflections
+    AmbientOcclusion,   // How open the surface is, without any lights
+    PathTrace,          // Global illumination, with next event estimation and MIS
+    Normals,            // Surface normals as colors
+    Depth,              // Distance to the first hit
+    TraversalCost       // Time spent tracing each pixel, as a heat map
+};
+
+struct IntegratorName
+{
+    IntegratorType type;
+    const char* pName;
+};
+
+// What the modes are called on the command line
+const IntegratorName IntegratorNames[] = {
+    { IntegratorType::Whitted, "whitted" },
+    { IntegratorType::AmbientOcclusion, "ao" },
+    { IntegratorType::PathTrace, "path" },
+    { IntegratorType::Normals, "normals" },
+    { IntegratorType::Depth, "depth" },
+    { IntegratorType::TraversalCost, "cost" }
+};
+
+// Look up a mode by name.  Fails if there isn't one
+inline bool FindIntegrator(const std::string& name, IntegratorType& type)
+{
+    for (auto& entry : IntegratorNames)
+    {
+        if (name == entry.pName)
+        {
+            type = entry.type;
+            return true;
+        }
+    }
+    return false;
+}
+
+// The names, for the help text
+inline std::string IntegratorNameList()
+{
+    std::string list;
+    for (auto& entry : IntegratorNames)
+    {
+        list += list.empty() ? "" : ", ";
+        list += entry.pName;
+    }
+    return list;
+}
+
+// Map [0, 1] to a blue - green - red ramp, for debug views
+inline vec3 HeatMap(float value)
+{
+    value = glm::clamp(value, 0.0f, 1.0f);
+    return vec3(glm::clamp(value * 2.0f - 1.0f, 0.0f, 1.0f),
+        1.0f - std::abs(value * 2.0f - 1.0f),
+        glm::clamp(1.0f - value * 2.0f, 0.0f, 1.0f));
+}
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <tuple>
+#include <utility>
+
+// Compile time specialised render kernels.
+// When the primitive types, the maximum trace depth and the shading model are all known at build time, the
+// whole trace loop can be expanded by the compiler with no virtual dispatch: primitives are copied by value
+// into one array per type, the path loop has a constant trip count, and the specular exponent is a constant.
+// Scenes using other types fall back to the generic TraceRay.
+
+// x ^ N, expanded at compile time by repeated squaring
+template<int N>
+inline float PowerOf(float x)
+{
+    return (N & 1 ? x : 1.0f) * PowerOf<N / 2>(x * x);
+}
+
+template<>
+inline float PowerOf<0>(float x)
+{
+    return 1.0f;
+}
+
+// The diffuse + specular lighting TraceRay does for each emitter, with a fixed specular exponent
+template<int SpecularPower>
+struct PhongShading
+{
+    static vec3 Shade(const Material& material, const vec3& normal, const vec3& reflect, const vec3& emitterDir, const vec3& emission)
+    {
+        float diffuseI = dot(normal, emitterDir);
+        float specI = 0.0f;
+        if (diffuseI > 0.0f)
+        {
+            specI = dot(reflect, emitterDir);
+            specI = specI > 0.0f ? PowerOf<SpecularPower>(specI) : 0.0f;
+        }
+        else
+        {
+            diffuseI = 0.0f;
+        }
+        return (emission * material.albedo * diffuseI) + (material.specular * specI);
+    }
+};
+
+// A copy of the scene made of a fixed set of primitive types, each stored by value in its own array.
+// The types should be 'final', so calls through them need no virtual dispatch.
+template<typename... Primitives>
+class StaticScene
+{
+public:
+    template<typename T>
+    struct Entry
+    {
+        T primitive;
+        uint32_t id;    // Index in the original scene; what goes in the hit record
+    };
+
+    // Copy the objects in.  Fails if any of them isn't one of our types
+    bool Build(const std::vector<std::shared_ptr<SceneObject>>& objects)
+    {
+        for (uint32_t id = 0; id < uint32_t(objects.size()); id++)
+        {
+            bool added = false;
+            ForEachType([&](auto& entries, auto)
+            {
+                using T = decltype(entries[0].primitive);
+                auto pPrimitive = dynamic_cast<const std::remove_reference_t<T>*>(objects[id].get());
+                if (!added && pPrimitive)
+                {
+                    entries.push_back({ *pPrimitive, id });
+                    added = true;
+                }
+            });
+
+            if (!added)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Call f(entries, std::integral_constant<size_t, TypeIndex>) for each type's array
+    template<typename F>
+    void ForEachType(F&& f)
+    {
+        ForEachTypeImpl(f, std::index_sequence_for<Primitives...>());
+    }
+
+    template<typename F>
+    void ForEachType(F&& f) const
+    {
+        ForEachTypeImpl(f, std::index_sequence_for<Primitives...>());
+    }
+
+    // Call f(primitive) on one primitive, given its type index and index within that type's array
+    template<typename F>
+    void Visit(size_t type, uint32_t index, F&& f) const
+    {
+        ForEachType([&](auto& entries, auto typeIndex)
+        {
+            if (decltype(typeIndex)::value == type)
+            {
+                f(entries[index].primitive);
+            }
+        });
+    }
+
+private:
+    template<typename F, size_t... I>
+    void ForEachTypeImpl(F& f, std::index_sequence<I...>)
+    {
+        int expand[] = { 0, (f(std::get<I>(arrays), std::integral_constant<size_t, I>()), 0)... };
+        (void)expand;
+    }
+
+    template<typename F, size_t... I>
+    void ForEachTypeImpl(F& f, std::index_sequence<I...>) const
+    {
+        int expand[] = { 0, (f(std::get<I>(arrays), std::integral_constant<size_t, I>()), 0)... };
+        (void)expand;
+    }
+
+    std::tuple<std::vector<Entry<Primitives>>...> arrays;
+};
+
+// TraceRay, specialised for one scene layout, depth and shading model
+template<int MaxDepth, typename ShadingModel, typename... Primitives>
+class StaticRenderer
+{
+public:
+    StaticRenderer(const StaticScene<Primitives...>& s, const MaterialTable& m, const PathSettings& p, const vec3& background)
+        : scene(s),
+        materials(m),
+        settings(p),
+        backgroundColor(background)
+    {
+    }
+
+    // Fills in pFirstHit, if given, with what the camera ray hit
+    vec3 operator()(const vec3& rayorig, const vec3& raydir, HitRecord* pFirstHit = nullptr) const
+    {
+        // The depth is a constant, so the compiler is free to unroll the path
+        vec3 outputColor{ 0.0f, 0.0f, 0.0f };
+        PathState path(rayorig, raydir);
+        for (int depth = 0; depth <= MaxDepth; depth++)
+        {
+            if (!Bounce(path, outputColor, depth == 0 ? pFirstHit : nullptr))
+            {
+                break;
+            }
+        }
+        return outputColor;
+    }
+
+private:
+    // Where in the static scene a hit was
+    struct StaticHit
+    {
+        HitRecord hit;
+        size_t type = 0;
+        uint32_t index = 0;
+    };
+
+    bool FindNearestHit(const vec3& rayorig, const vec3& raydir, StaticHit& nearest) const
+    {
+        scene.ForEachType([&](auto& entries, auto typeIndex)
+        {
+            for (uint32_t i = 0; i < uint32_t(entries.size()); i++)
+            {
+                HitRecord hit;
+                if (entries[i].primitive.Intersects(rayorig, raydir, hit) &&
+                    nearest.hit.distance > hit.distance)
+                {
+                    nearest.hit = hit;
+                    nearest.hit.primitiveId = entries[i].id;
+                    nearest.type = decltype(typeIndex)::value;
+                    nearest.index = i;
+                }
+            }
+        });
+        return nearest.hit.primitiveId != NoPrimitive;
+    }
+
+    bool IsOccluded(const vec3& rayorig, const vec3& raydir, float maxDistance, uint32_t ignoreId) const
+    {
+        bool occluded = false;
+        scene.ForEachType([&](auto& entries, auto)
+        {
+            for (uint32_t i = 0; i < uint32_t(entries.size()) && !occluded; i++)
+            {
+                HitRecord hit;
+                occluded = entries[i].id != ignoreId &&
+                    entries[i].primitive.Intersects(rayorig, raydir, hit) &&
+                    hit.distance < maxDistance;
+            }
+        });
+        return occluded;
+    }
+
+    // Shade one hit along the path and move the path on to its reflection.  Returns false when it ends
+    bool Bounce(PathState& path, vec3& outputColor, HitRecord* pHit) const
+    {
+        StaticHit nearest;
+        bool found = FindNearestHit(path.origin, path.direction, nearest);
+        if (pHit)
+        {
+            *pHit = nearest.hit;
+        }
+        if (!found)
+        {
+            outputColor += path.throughput * backgroundColor;
+            return false;
+        }
+
+        vec3 pos = path.origin + (path.direction * nearest.hit.distance);
+        vec3 normal;
+        MaterialId materialId = 0;
+        scene.Visit(nearest.type, nearest.index, [&](auto& primitive)
+        {
+            normal = primitive.GetSurfaceNormal(nearest.hit, pos);
+            materialId = primitive.GetMaterialId(nearest.hit, pos);
+        });
+        const Material& material = materials[materialId];
+
+        vec3 reflect = glm::normalize(glm::reflect(path.direction, normal));
+        vec3 lightColor{ 0.0f, 0.0f, 0.0f };
+
+        // For every emitter, gather the light
+        scene.ForEachType([&](auto& emitters, auto)
+        {
+            for (auto& emitter : emitters)
+            {
+                vec3 emitterDir = emitter.primitive.GetRayFrom(pos);
+                vec3 shadowOrigin = pos + (emitterDir * 0.001f);
+
+                HitRecord emitterHit;
+                if (!emitter.primitive.Intersects(shadowOrigin, emitterDir, emitterHit))
+                {
+                    continue;
+                }
+
+                // Only emissive points are worth a shadow ray
+                const Material& emitterMat = materials[emitter.primitive.GetMaterialId(emitterHit, pos + (emitterDir * emitterHit.distance))];
+                if (emitterMat.emissive == vec3(0.0f, 0.0f, 0.0f) ||
+                    IsOccluded(shadowOrigin, emitterDir, emitterHit.distance, emitter.id))
+                {
+                    continue;
+                }
+                lightColor += ShadingModel::Shade(material, normal, reflect, emitterDir, emitterMat.emissive);
+            }
+        });
+
+        outputColor += path.throughput * ((lightColor * (1.f - material.reflectance)) + material.emissive);
+
+        return path.depth < MaxDepth &&
+            material.reflectance > 0.0f &&
+            path.Extend(pos + (reflect * 0.001f), reflect, material.reflectance * (1.f - material.reflectance), settings);
+    }
+
+    const StaticScene<Primitives...>& scene;
+    const MaterialTable& materials;
+    PathSettings settings;
+    vec3 backgroundColor;
+};
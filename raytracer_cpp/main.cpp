@@ -3,6 +3,20 @@
 #include "writebitmap.h"
 #include "sceneobjects.h"
 #include "camera.h"
+#include "tessellation.h"
+#include "sdf.h"
+#include "pathstate.h"
+#include "sampler.h"
+#include "filter.h"
+#include "edges.h"
+#include "region.h"
+#include "kernels.h"
+#include "shading.h"
+#include "lights.h"
+#include "occludercache.h"
+#include "wavefront.h"
+#include "pathtracing.h"
+#include "integrator.h"
 
 #include <thread>
 #include <chrono>
@@ -15,10 +29,33 @@ const float FieldOfView = 60.0f;
 
 #define MAX_DEPTH 5
 
+// The path tracer needs more bounces than the reflections do, to carry light between diffuse surfaces
+#define PATH_DEPTH 8
+
+const vec3 BackgroundColor{0.1f, 0.1f, 0.1f};
+
+// Sub pixel sample positions for antialiasing, when not using a sampler
+const int SamplePatternSize = 4;
+const vec2 SamplePatterns[SamplePatternSize]{vec2(0.1f, 0.2f), vec2(0.6f, 0.5f), vec2(0.8f, 0.7f), vec2(0.2f, 0.8f)};
+
+// Diced patches kept in memory at once, across all displaced surfaces.  Fewer than the demo surface's 32 patches,
+// so rendering it evicts
+const int TessellationCacheSize = 24;
+
 std::vector<std::shared_ptr<SceneObject>> sceneObjects;
+MaterialTable materials;
+PathSettings pathSettings;
+LightTree lightTree;
+int lightSamples = 0;   // Lights picked from the tree per hit; 0 shades them all
+bool useOccluderCache = true;
+SamplerType samplerType = SamplerType::Sobol;
+int ambientOcclusionSamples = 4;        // Rays cast from each hit in the ao mode
+float ambientOcclusionDistance = 1.5f;  // And how far they look
+EmitterSampler emitterSampler;
 std::shared_ptr<Camera> pCamera;
+std::shared_ptr<TessellationCache> pTessellationCache;
 
-void InitScene()
+void InitScene(bool displaced, bool distanceFields, bool mirrors, int extraLights)
 {
     pCamera = std::make_shared<Camera>(vec3(0.0f, 6.0f, 8.0f),   // Where the camera is
                                        vec3(0.0f, -.8f, -1.0f),  // The point it is looking at
@@ -30,164 +67,566 @@ void InitScene()
     mat.albedo = vec3(.7f, .1f, .1f);
     mat.specular = vec3(.9f, .1f, .1f);
     mat.reflectance = 0.5f;
-    sceneObjects.push_back(std::make_shared<Sphere>(mat, vec3(0.0f, 2.0f, 0.f), 2.0f));
+    sceneObjects.push_back(std::make_shared<Sphere>(materials.Add(mat), vec3(0.0f, 2.0f, 0.f), 2.0f));
 
     // Purple ball
     mat.albedo = vec3(0.7f, 0.0f, 0.7f);
     mat.specular = vec3(0.9f, 0.9f, 0.8f);
     mat.reflectance = 0.5f;
-    sceneObjects.push_back(std::make_shared<Sphere>(mat, vec3(-2.5f, 1.0f, 2.f), 1.0f));
+    sceneObjects.push_back(std::make_shared<Sphere>(materials.Add(mat), vec3(-2.5f, 1.0f, 2.f), 1.0f));
 
     // Blue ball
     mat.albedo = vec3(0.0f, 0.3f, 1.0f);
     mat.specular = vec3(0.0f, 0.0f, 1.0f);
     mat.reflectance = 0.0f;
     mat.emissive = vec3(0.0f, 0.0f, 0.0f);
-    sceneObjects.push_back(std::make_shared<Sphere>(mat, vec3(-0.0f, 0.5f, 3.f), 0.5f));
+    sceneObjects.push_back(std::make_shared<Sphere>(materials.Add(mat), vec3(-0.0f, 0.5f, 3.f), 0.5f));
 
     // White ball
     mat.albedo = vec3(1.0f, 1.0f, 1.0f);
     mat.specular = vec3(0.0f, 0.0f, 0.0f);
     mat.reflectance = .0f;
     mat.emissive = vec3(1.0f, 1.0f, 0.0f);
-    sceneObjects.push_back(std::make_shared<Sphere>(mat, vec3(2.8f, 0.8f, 2.0f), 0.8f));
+    sceneObjects.push_back(std::make_shared<Sphere>(materials.Add(mat), vec3(2.8f, 0.8f, 2.0f), 0.8f));
 
     // White light
     mat.albedo = vec3(0.0f, 0.8f, 0.0f);
     mat.specular = vec3(0.0f, 0.0f, 0.0f);
     mat.reflectance = 0.0f;
     mat.emissive = vec3(1.0f, 1.0f, 1.0f);
-    sceneObjects.push_back(std::make_shared<Sphere>(mat, vec3(-10.8f, 8.4f, 10.0f), 0.4f));
+    sceneObjects.push_back(std::make_shared<Sphere>(materials.Add(mat), vec3(-10.8f, 8.4f, 10.0f), 0.4f));
+
+    // Checkered floor
+    Material blackMat;
+    blackMat.reflectance = 0.6f;
+    blackMat.specular = vec3(0.0f, 0.0f, 0.0f);
+    blackMat.albedo = vec3(0.0f, 0.0f, 0.0f);
+
+    Material whiteMat;
+    whiteMat.reflectance = 0.6f;
+    whiteMat.specular = vec3(1.0f, 1.0f, 1.0f);
+    whiteMat.albedo = vec3(1.0f, 1.0f, 1.0f);
+    sceneObjects.push_back(std::make_shared<TiledPlane>(materials.Add(blackMat), materials.Add(whiteMat), vec3(0.0f, 0.0f, 0.0f), normalize(vec3(0.0f, 1.0f, 0.0f))));
+
+    if (mirrors)
+    {
+        // A field of small mirrored balls around the others, to scatter lots of reflections
+        mat.albedo = vec3(0.3f, 0.3f, 0.3f);
+        mat.specular = vec3(0.8f, 0.8f, 0.8f);
+        mat.reflectance = 0.8f;
+        mat.emissive = vec3(0.0f, 0.0f, 0.0f);
+        auto mirrorId = materials.Add(mat);
+        for (int z = -4; z <= 1; z++)
+        {
+            for (int x = -5; x <= 5; x++)
+            {
+                sceneObjects.push_back(std::make_shared<Sphere>(mirrorId, vec3(float(x) * 1.6f, 0.35f, float(z) * 1.6f - 1.5f), 0.35f));
+            }
+        }
+    }
+
+    if (displaced)
+    {
+        // Rolling hills behind the balls, only diced where rays reach them
+        pTessellationCache = std::make_shared<TessellationCache>(TessellationCacheSize);
+
+        const int pointsX = 11;
+        const int pointsZ = 7;
+        std::vector<float> heights;
+        for (int z = 0; z < pointsZ; z++)
+        {
+            for (int x = 0; x < pointsX; x++)
+            {
+                heights.push_back(1.0f + float((x * 7 + z * 3) % 5) * 0.6f);
+            }
+        }
+
+        mat.albedo = vec3(0.4f, 0.6f, 0.3f);
+        mat.specular = vec3(0.2f, 0.2f, 0.2f);
+        mat.reflectance = 0.0f;
+        mat.emissive = vec3(0.0f, 0.0f, 0.0f);
+        sceneObjects.push_back(std::make_shared<DisplacedSurface>(materials.Add(mat), pTessellationCache, 0, vec3(-10.0f, 0.0f, -14.0f), 2.0f, pointsX, pointsZ, heights, 0.15f, 32));
+    }
 
-    sceneObjects.push_back(std::make_shared<TiledPlane>(vec3(0.0f, 0.0f, 0.0f), normalize(vec3(0.0f, 1.0f, 0.0f))));
+    if (distanceFields)
+    {
+        // Procedural detail with no mesh memory
+        mat.albedo = vec3(0.9f, 0.6f, 0.1f);
+        mat.specular = vec3(0.8f, 0.8f, 0.8f);
+        mat.reflectance = 0.2f;
+        mat.emissive = vec3(0.0f, 0.0f, 0.0f);
+        sceneObjects.push_back(std::make_shared<SdfBlob>(materials.Add(mat), std::vector<vec4>{ vec4(-5.5f, 0.8f, -2.0f, 0.8f), vec4(-4.6f, 1.4f, -2.4f, 0.7f), vec4(-5.0f, 2.1f, -1.6f, 0.5f) }, 0.6f));
+
+        mat.albedo = vec3(0.2f, 0.8f, 0.7f);
+        mat.specular = vec3(0.5f, 0.5f, 0.5f);
+        mat.reflectance = 0.0f;
+        sceneObjects.push_back(std::make_shared<SdfCsg>(materials.Add(mat), vec3(5.0f, 1.0f, -1.5f), 1.0f));
+
+        mat.albedo = vec3(0.8f, 0.8f, 0.8f);
+        mat.specular = vec3(0.3f, 0.3f, 0.3f);
+        mat.reflectance = 0.0f;
+        sceneObjects.push_back(std::make_shared<SdfMengerSponge>(materials.Add(mat), vec3(0.0f, 1.5f, -5.0f), 1.5f, 4));
+    }
+
+    // Small colored lights, spiralling out over the floor
+    for (int i = 0; i < extraLights; i++)
+    {
+        float angle = float(i) * 2.4f;
+        float distance = 4.0f + float(i) * (8.0f / float(extraLights));
+        mat.albedo = vec3(0.0f, 0.0f, 0.0f);
+        mat.specular = vec3(0.0f, 0.0f, 0.0f);
+        mat.reflectance = 0.0f;
+        mat.emissive = vec3(0.5f + 0.5f * std::sin(angle), 0.5f + 0.5f * std::sin(angle + 2.1f), 0.5f + 0.5f * std::sin(angle + 4.2f)) * (16.0f / float(extraLights));
+        sceneObjects.push_back(std::make_shared<Sphere>(materials.Add(mat), vec3(std::cos(angle) * distance, 0.6f, std::sin(angle) * distance - 3.0f), 0.15f));
+    }
+
+    lightTree.Build(sceneObjects, materials);
+    emitterSampler.Build(sceneObjects, materials);
 }
 
-SceneObject *FindNearestObject(vec3 rayorig, vec3 raydir, float &nearestDistance)
+// Find the closest hit along the ray.  Only the hit record is filled in; surface attributes are left until
+// the caller knows it needs them
+bool FindNearestHit(const vec3 &rayorig, const vec3 &raydir, HitRecord &nearest)
 {
-    SceneObject *nearestObject = nullptr;
-    nearestDistance = std::numeric_limits<float>::max();
-
-    // find intersection of this ray with the sphere in the scene
-    for (auto pObject : sceneObjects)
+    nearest = HitRecord();
+    for (uint32_t id = 0; id < uint32_t(sceneObjects.size()); id++)
     {
-        float distance;
-        if (pObject->Intersects(rayorig, raydir, distance) &&
-            nearestDistance > distance)
+        HitRecord hit;
+        if (sceneObjects[id]->Intersects(rayorig, raydir, hit) &&
+            nearest.distance > hit.distance)
         {
-            nearestObject = pObject.get();
-            nearestDistance = distance;
+            nearest = hit;
+            nearest.primitiveId = id;
         }
     }
-    return nearestObject;
+    return nearest.primitiveId != NoPrimitive;
 }
 
-vec3 TraceRay(const vec3 &rayorig, const vec3 &raydir, const int depth)
+// Is anything other than the ignored object hit closer than maxDistance?  Returns at the first such hit.
+// The ignored object is the light being looked for, so the thread's occluder cache is checked first; rays
+// that aren't looking for a light pass NoPrimitive, and don't use the cache.
+// Callers that know only a few objects can be in reach pass them as candidates, and the rest aren't tested
+bool IsOccluded(const vec3 &rayorig, const vec3 &raydir, float maxDistance, uint32_t ignoreId, const std::vector<uint32_t> *pCandidates = nullptr)
 {
-    const SceneObject *nearestObject = nullptr;
-    float distance;
-    nearestObject = FindNearestObject(rayorig, raydir, distance);
+    bool useCache = useOccluderCache && ignoreId != NoPrimitive;
+    uint32_t cachedId = NoPrimitive;
+    if (useCache)
+    {
+        cachedId = OccluderCache::ForThread().Get(ignoreId);
+        HitRecord hit;
+        if (cachedId != NoPrimitive &&
+            sceneObjects[cachedId]->Intersects(rayorig, raydir, hit) &&
+            hit.distance < maxDistance)
+        {
+            OccluderCache::ForThread().hits++;
+            return true;
+        }
+    }
 
-    if (!nearestObject)
+    uint32_t count = pCandidates ? uint32_t(pCandidates->size()) : uint32_t(sceneObjects.size());
+    for (uint32_t i = 0; i < count; i++)
     {
-        return vec3{0.1f, 0.1f, 0.1f};
+        uint32_t id = pCandidates ? (*pCandidates)[i] : i;
+        HitRecord hit;
+        if (id != ignoreId &&
+            id != cachedId &&
+            sceneObjects[id]->Intersects(rayorig, raydir, hit) &&
+            hit.distance < maxDistance)
+        {
+            if (useCache)
+            {
+                OccluderCache::ForThread().Set(ignoreId, id);
+                OccluderCache::ForThread().misses++;
+            }
+            return true;
+        }
     }
-    vec3 pos = rayorig + (raydir * distance);
-    vec3 normal = nearestObject->GetSurfaceNormal(pos);
-    vec3 outputColor{0.0f, 0.0f, 0.0f};
 
-    const Material &material = nearestObject->GetMaterial(pos);
+    if (useCache)
+    {
+        OccluderCache::ForThread().unoccluded++;
+    }
+    return false;
+}
 
-    vec3 reflect = glm::normalize(glm::reflect(raydir, normal));
+// Gather the direct light from the emitters at a surface point.  With light sampling on, emissive spheres are
+// picked at random from the light tree instead of all being shaded, and weighted to keep the average right
+vec3 GatherEmitters(const vec3 &pos, const vec3 &normal, const vec3 &reflect, MaterialId materialId)
+{
+    // The visible emitters are collected and then shaded together
+    thread_local ShadingBatch batch;
+    thread_local std::vector<float> weights;
+    if (batch.Size() < sceneObjects.size() + lightSamples)
+    {
+        batch.Resize(sceneObjects.size() + lightSamples);
+        weights.resize(batch.Size());
+    }
+    size_t visibleCount = 0;
 
-    // If the object is transparent, get the reflection color
-    if (depth < MAX_DEPTH && (material.reflectance > 0.0f))
+    auto addEmitter = [&](uint32_t emitterId, float weight)
     {
-        vec3 reflectColor(0.0f, 0.0f, 0.0f);
-        vec3 refractColor(0.0f, 0.0f, 0.0f);
+        const SceneObject *pEmitter = sceneObjects[emitterId].get();
+        vec3 emitterDir = pEmitter->GetRayFrom(pos);
+        vec3 shadowOrigin = pos + (emitterDir * 0.001f);
 
-        reflectColor = TraceRay(pos + (reflect * 0.001f), reflect, depth + 1);
-        outputColor = (reflectColor * material.reflectance);
-    }
-    // For every emitter, gather the light
-    for (auto &emitterObj : sceneObjects)
+        // Where do we reach the emitter?
+        HitRecord emitterHit;
+        if (!pEmitter->Intersects(shadowOrigin, emitterDir, emitterHit))
+        {
+            return;
+        }
+
+        // Only light if the point we reached is emissive; most objects aren't, and then there's no shadow ray
+        // to cast
+        const Material &emitterMat = materials[pEmitter->GetMaterialId(emitterHit, pos + (emitterDir * emitterHit.distance))];
+        if (emitterMat.emissive == vec3(0.0f, 0.0f, 0.0f))
+        {
+            return;
+        }
+
+        // Anything in front of it blocks the light; it doesn't matter what, or which is nearest
+        if (IsOccluded(shadowOrigin, emitterDir, emitterHit.distance, emitterId))
+        {
+            return;
+        }
+
+        weights[visibleCount] = weight;
+        batch.Set(visibleCount++, materialId, normal, reflect, emitterDir, emitterMat.emissive);
+    };
+
+    if (lightSamples > 0 && !lightTree.Empty())
     {
-        vec3 emitterDir = emitterObj->GetRayFrom(pos);
+        for (auto emitterId : lightTree.GetUnsampled())
+        {
+            addEmitter(emitterId, 1.0f);
+        }
 
-        float bestDistance = std::numeric_limits<float>::max();
-        SceneObject *pOccluder = nullptr;
-        const Material *pEmissiveMat = nullptr;
-        for (auto &occluder : sceneObjects)
+        for (int i = 0; i < lightSamples; i++)
         {
-            if (occluder->Intersects(pos + (emitterDir * 0.001f), emitterDir, distance))
+            LightSample sample;
+            if (lightTree.Sample(pos, normal, Sampler::ForThread().Get1D(), sample))
             {
-                if (occluder == emitterObj)
-                {
-                    if (bestDistance > distance)
-                    {
-                        bestDistance = distance;
-
-                        // If we found our emitter, and the point we hit is not emissive, then ignore
-                        pEmissiveMat = &occluder->GetMaterial(pos + (emitterDir * distance));
-                        if (pEmissiveMat->emissive == vec3(0.0f, 0.0f, 0.0f))
-                        {
-                            pEmissiveMat = nullptr;
-                        }
-                        else
-                        {
-                            pOccluder = nullptr;
-                        }
-                    }
-                }
-                else
-                {
-                    if (bestDistance > distance)
-                    {
-                        pOccluder = occluder.get();
-                        pEmissiveMat = nullptr;
-                        bestDistance = distance;
-                    }
-                }
+                addEmitter(sample.emitterId, 1.0f / (sample.pdf * float(lightSamples)));
             }
         }
+    }
+    else
+    {
+        for (uint32_t emitterId = 0; emitterId < uint32_t(sceneObjects.size()); emitterId++)
+        {
+            addEmitter(emitterId, 1.0f);
+        }
+    }
 
-        // No emissive material, or occluder
-        if (!pEmissiveMat || pOccluder)
+    ShadeBatch<10>(batch, materials, 0, visibleCount);
+
+    vec3 outputColor{0.0f, 0.0f, 0.0f};
+    for (size_t i = 0; i < visibleCount; i++)
+    {
+        outputColor += batch.Color(i) * weights[i];
+    }
+    return outputColor;
+}
+
+// Follow a ray and its reflections.  Rather than recursing, we walk down the path carrying the weight the rest
+// of it has in the final color, and stop when that weight is too small to matter
+vec3 TraceRay(const vec3 &rayorig, const vec3 &raydir, HitRecord *pFirstHit = nullptr)
+{
+    vec3 outputColor{0.0f, 0.0f, 0.0f};
+    PathState path(rayorig, raydir);
+    for (;;)
+    {
+        HitRecord hit;
+        bool found = FindNearestHit(path.origin, path.direction, hit);
+        if (pFirstHit && path.depth == 0)
+        {
+            *pFirstHit = hit;
+        }
+        if (!found)
         {
-            continue;
+            outputColor += path.throughput * BackgroundColor;
+            break;
         }
+        ShadingPoint surface(sceneObjects[hit.primitiveId].get(), hit, path.origin, path.direction);
+        const vec3 &pos = surface.GetPosition();
+        const vec3 &normal = surface.GetNormal();
+
+        const Material &material = materials[surface.GetMaterialId()];
 
-        float diffuseI = 0.0f;
-        float specI = 0.0f;
+        vec3 reflect = glm::normalize(glm::reflect(path.direction, normal));
 
-        diffuseI = dot(normal, emitterDir); /// / (bestDistance * bestDistance);
+        // The surface keeps (1 - reflectance) of its own lighting; the reflection is scaled by both, and
+        // carried on to the next bounce
+        vec3 surfaceColor = GatherEmitters(pos, normal, reflect, surface.GetMaterialId()) * (1.f - material.reflectance);
+        surfaceColor += material.emissive;
+        outputColor += path.throughput * surfaceColor;
 
-        if (diffuseI > 0.0f)
+        if (path.depth >= MAX_DEPTH ||
+            material.reflectance <= 0.0f ||
+            !path.Extend(pos + (reflect * 0.001f), reflect, material.reflectance * (1.f - material.reflectance), pathSettings))
         {
-            specI = dot(reflect, emitterDir);
-            if (specI > 0.0f)
-            {
-                specI = pow(specI, 10);
-                specI = std::max(0.0f, specI);
+            break;
+        }
+    }
+    return outputColor;
+}
 
-                //specI /= (bestDistance * bestDistance);
-            }
-            else
+// Light arriving from one emitter, picked and aimed at by the emitter sampler (next event estimation).
+// Weighted against the chance of the BSDF sampling the same direction
+vec3 SampleEmitter(const vec3 &pos, const PhongBsdf &bsdf)
+{
+    uint32_t emitterId;
+    vec3 emitterDir;
+    float lightPdf;
+    auto &sampler = Sampler::ForThread();
+    float emitterSample = sampler.Get1D();
+    vec2 directionSample = sampler.Get2D();
+    if (emitterSampler.Empty() || !emitterSampler.Sample(pos, emitterSample, directionSample, emitterId, emitterDir, lightPdf))
+    {
+        return vec3(0.0f);
+    }
+
+    vec3 f = bsdf.Evaluate(emitterDir);
+    if (f == vec3(0.0f))
+    {
+        return vec3(0.0f);
+    }
+
+    const SceneObject *pEmitter = sceneObjects[emitterId].get();
+    vec3 shadowOrigin = pos + (emitterDir * 0.001f);
+    HitRecord emitterHit;
+    if (!pEmitter->Intersects(shadowOrigin, emitterDir, emitterHit) ||
+        IsOccluded(shadowOrigin, emitterDir, emitterHit.distance, emitterId))
+    {
+        return vec3(0.0f);
+    }
+
+    const Material &emitterMat = materials[pEmitter->GetMaterialId(emitterHit, shadowOrigin + (emitterDir * emitterHit.distance))];
+    float weight = PowerHeuristic(lightPdf, bsdf.Pdf(emitterDir));
+    return emitterMat.emissive * f * (dot(bsdf.normal, emitterDir) * weight / lightPdf);
+}
+
+// Follow a path of random bounces, gathering the light from the emitters at each.  The light reaching a point
+// is estimated both by sampling an emitter and by the next bounce happening to hit one; multiple importance
+// sampling weights the two so their sum is unbiased
+vec3 PathTraceRay(const vec3 &rayorig, const vec3 &raydir, HitRecord *pFirstHit = nullptr)
+{
+    vec3 outputColor{0.0f, 0.0f, 0.0f};
+    PathState path(rayorig, raydir);
+    float bsdfPdf = 0.0f; // Density of the direction we arrived along; 0 from the camera or a mirror
+    for (;;)
+    {
+        HitRecord hit;
+        bool found = FindNearestHit(path.origin, path.direction, hit);
+        if (pFirstHit && path.depth == 0)
+        {
+            *pFirstHit = hit;
+        }
+        if (!found)
+        {
+            outputColor += path.throughput * BackgroundColor;
+            break;
+        }
+        const SceneObject *pObject = sceneObjects[hit.primitiveId].get();
+        ShadingPoint surface(pObject, hit, path.origin, path.direction);
+        const vec3 &pos = surface.GetPosition();
+        const vec3 &normal = surface.GetNormal();
+
+        const Material &material = materials[surface.GetMaterialId()];
+
+        // Emitters we bounce into.  Sampling them directly could have found them too, unless we got here
+        // from the camera or a mirror
+        if (material.emissive != vec3(0.0f))
+        {
+            float weight = 1.0f;
+            if (bsdfPdf > 0.0f)
             {
-                specI = 0.0f;
+                weight = PowerHeuristic(bsdfPdf, emitterSampler.Pdf(hit.primitiveId, pObject, path.origin));
             }
+            outputColor += path.throughput * material.emissive * weight;
         }
-        else
+
+        vec3 reflect = glm::normalize(glm::reflect(path.direction, normal));
+        PhongBsdf bsdf(material, normal, reflect);
+        outputColor += path.throughput * SampleEmitter(pos, bsdf);
+
+        if (path.depth >= PATH_DEPTH)
+        {
+            break;
+        }
+
+        vec3 bounceDir;
+        bool mirror;
+        float lobeSample = Sampler::ForThread().Get1D();
+        vec3 weight = bsdf.Sample(lobeSample, Sampler::ForThread().Get2D(), bounceDir, bsdfPdf, mirror);
+        if (weight == vec3(0.0f))
         {
-            diffuseI = 0.0f;
+            break;
+        }
+        path.throughput *= weight;
+        if (!path.Extend(pos + (bounceDir * 0.001f), bounceDir, 1.0f, pathSettings))
+        {
+            break;
         }
-        outputColor += (pEmissiveMat->emissive * material.albedo * diffuseI) + (material.specular * specI);
     }
-    outputColor *= 1.f - material.reflectance;
-    outputColor += material.emissive;
     return outputColor;
 }
 
-void DrawScene(Bitmap *pBitmap, int partitions, bool antialias)
+// The fraction of the hemisphere above the first hit that is open, cosine weighted, out to
+// ambientOcclusionDistance.  There are no lights and no reflections, only the primary ray and a few short
+// any-hit rays, so it is a fast preview of the shapes in a scene
+vec3 AmbientOcclusionRay(const vec3 &rayorig, const vec3 &raydir, HitRecord *pFirstHit = nullptr)
+{
+    HitRecord hit;
+    bool found = FindNearestHit(rayorig, raydir, hit);
+    if (pFirstHit)
+    {
+        *pFirstHit = hit;
+    }
+    if (!found)
+    {
+        return BackgroundColor;
+    }
+    ShadingPoint surface(sceneObjects[hit.primitiveId].get(), hit, rayorig, raydir);
+    const vec3 &pos = surface.GetPosition();
+    const vec3 &normal = surface.GetNormal();
+
+    // Only objects that come within reach of the point can shut it in; with none, it is open without casting
+    // anything
+    thread_local std::vector<uint32_t> nearby;
+    nearby.clear();
+    for (uint32_t id = 0; id < uint32_t(sceneObjects.size()); id++)
+    {
+        if (sceneObjects[id]->MayBeWithin(pos, ambientOcclusionDistance))
+        {
+            nearby.push_back(id);
+        }
+    }
+    if (nearby.empty())
+    {
+        return vec3(1.0f);
+    }
+
+    // One ray per stratum of cos^2(theta), each turned a golden ratio of a circle from the last, and the whole
+    // set shifted by one sample point, so even a few rays cover the hemisphere evenly
+    vec2 shift = Sampler::ForThread().Get2D();
+    int open = 0;
+    for (int i = 0; i < ambientOcclusionSamples; i++)
+    {
+        float u = (float(i) + shift.x) / float(ambientOcclusionSamples);
+        float turn = float(i) * 0.618034f + shift.y;
+        vec3 dir = DirectionAround(normal, std::sqrt(1.0f - u), 2.0f * Pi * (turn - std::floor(turn)));
+        if (!IsOccluded(pos + (dir * 0.001f), dir, ambientOcclusionDistance, NoPrimitive, &nearby))
+        {
+            open++;
+        }
+    }
+    return vec3(float(open) / float(ambientOcclusionSamples));
+}
+
+// Distance at which the depth view has faded to a third
+const float DepthFalloff = 10.0f;
+
+// Microseconds per camera ray that show as the top of the traversal cost heat map
+const float CostScale = 4.0f;
+
+// The render modes
+struct WhittedIntegrator : Integrator
+{
+    vec3 Trace(const vec3 &rayorig, const vec3 &raydir, HitRecord *pFirstHit) const override
+    {
+        return TraceRay(rayorig, raydir, pFirstHit);
+    }
+};
+
+struct AmbientOcclusionIntegrator : Integrator
+{
+    vec3 Trace(const vec3 &rayorig, const vec3 &raydir, HitRecord *pFirstHit) const override
+    {
+        return AmbientOcclusionRay(rayorig, raydir, pFirstHit);
+    }
+};
+
+struct PathIntegrator : Integrator
+{
+    vec3 Trace(const vec3 &rayorig, const vec3 &raydir, HitRecord *pFirstHit) const override
+    {
+        return PathTraceRay(rayorig, raydir, pFirstHit);
+    }
+};
+
+struct NormalsIntegrator : Integrator
+{
+    vec3 Trace(const vec3 &rayorig, const vec3 &raydir, HitRecord *pFirstHit) const override
+    {
+        HitRecord hit;
+        bool found = FindNearestHit(rayorig, raydir, hit);
+        if (pFirstHit)
+        {
+            *pFirstHit = hit;
+        }
+        if (!found)
+        {
+            return vec3(0.0f);
+        }
+        ShadingPoint surface(sceneObjects[hit.primitiveId].get(), hit, rayorig, raydir);
+        return surface.GetNormal() * 0.5f + vec3(0.5f);
+    }
+};
+
+struct DepthIntegrator : Integrator
+{
+    vec3 Trace(const vec3 &rayorig, const vec3 &raydir, HitRecord *pFirstHit) const override
+    {
+        HitRecord hit;
+        bool found = FindNearestHit(rayorig, raydir, hit);
+        if (pFirstHit)
+        {
+            *pFirstHit = hit;
+        }
+        if (!found)
+        {
+            return vec3(0.0f);
+        }
+        return vec3(std::exp(-hit.distance / DepthFalloff));
+    }
+};
+
+// The whole of the Whitted trace is timed, so expensive primitives, long reflection paths and shadow rays all
+// show up
+struct TraversalCostIntegrator : Integrator
+{
+    vec3 Trace(const vec3 &rayorig, const vec3 &raydir, HitRecord *pFirstHit) const override
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        TraceRay(rayorig, raydir, pFirstHit);
+        auto end = std::chrono::high_resolution_clock::now();
+        return HeatMap(float(std::chrono::duration<double, std::micro>(end - start).count()) / CostScale);
+    }
+};
+
+std::unique_ptr<Integrator> CreateIntegrator(IntegratorType type)
+{
+    switch (type)
+    {
+    case IntegratorType::AmbientOcclusion:
+        return std::make_unique<AmbientOcclusionIntegrator>();
+    case IntegratorType::PathTrace:
+        return std::make_unique<PathIntegrator>();
+    case IntegratorType::Normals:
+        return std::make_unique<NormalsIntegrator>();
+    case IntegratorType::Depth:
+        return std::make_unique<DepthIntegrator>();
+    case IntegratorType::TraversalCost:
+        return std::make_unique<TraversalCostIntegrator>();
+    default:
+        return std::make_unique<WhittedIntegrator>();
+    }
+}
+
+// Run a function on every row, spread over the threads
+template <typename RowFunction>
+void ForEachRow(int partitions, const RowFunction &drawRow)
 {
     std::vector<std::shared_ptr<std::thread>> threads;
     for (int i = 0; i < partitions; i++)
@@ -195,26 +634,7 @@ void DrawScene(Bitmap *pBitmap, int partitions, bool antialias)
         auto pT = std::make_shared<std::thread>([&](int offset) {
             for (int y = offset; y < ImageHeight; y += partitions)
             {
-                for (int x = 0; x < ImageWidth; x++)
-                {
-                    const int numSamples = antialias ? 4 : 1;
-                    vec3 color{0.0f, 0.0f, 0.0f};
-                    static vec2 patterns[4]{vec2(0.1f, 0.2f), vec2(0.6f, 0.5f), vec2(0.8f, 0.7f), vec2(0.2f, 0.8f)};
-                    for (auto i = 0; i < numSamples; i++)
-                    {
-                        vec2 sample(float(x) + patterns[i].x, float(y) + patterns[i].y);
-
-                        auto ray = pCamera->GetWorldRay(sample);
-                        color += TraceRay(pCamera->position, ray, 0);
-                    }
-                    color *= (1.0f / numSamples);
-
-                    // Color might have maxed out, so clamp.
-                    color = color * 255.0f;
-                    color = clamp(color, vec3(0.0f, 0.0f, 0.0f), vec3(255.0f, 255.0f, 255.0f));
-
-                    PutPixel(pBitmap, x, y, Color{uint8_t(color.x), uint8_t(color.y), uint8_t(color.z)});
-                }
+                drawRow(y);
             }
         },
                                                 i);
@@ -227,30 +647,309 @@ void DrawScene(Bitmap *pBitmap, int partitions, bool antialias)
     }
 }
 
+// What the camera ray hit first, as the tracer reported it, for edge detection
+PrimaryHit ToPrimaryHit(const HitRecord &hit, const vec3 &rayorig, const vec3 &raydir)
+{
+    PrimaryHit primary;
+    if (hit.primitiveId != NoPrimitive)
+    {
+        ShadingPoint surface(sceneObjects[hit.primitiveId].get(), hit, rayorig, raydir);
+        primary.primitiveId = hit.primitiveId;
+        primary.material = surface.GetMaterialId();
+        primary.normal = surface.GetNormal();
+        primary.distance = hit.distance;
+    }
+    return primary;
+}
+
+// Render every pixel, with any function of (origin, direction, first hit) that returns a color; given a hit
+// record, it fills in what the camera ray hit.
+// Each pixel takes numSamples samples over the filter's footprint, and is their weighted average.  With a
+// sampler, each pixel sample starts the thread's sampler, and its position is the first thing drawn from it;
+// otherwise every pixel uses the fixed sample pattern.
+// With edgesOnly, every pixel takes its first sample, and only the pixels found on geometric edges take the rest.
+// Only the pixels in the region are drawn, unless it is empty
+template <typename Tracer>
+void DrawSceneWith(Bitmap *pBitmap, int partitions, int numSamples, bool edgesOnly, bool useSampler, const PixelFilter &filter, const PixelRect &region, const Tracer &traceRay)
+{
+    edgesOnly = edgesOnly && numSamples > 1;
+    auto inRegion = [&](int x, int y) {
+        return region.Empty() || region.Contains(x, y);
+    };
+
+    // Weighted sums of each pixel's samples, and their total weight
+    std::vector<vec4> sums(ImageWidth * ImageHeight, vec4(0.0f));
+    std::vector<PrimaryHit> primaryHits(edgesOnly ? ImageWidth * ImageHeight : 0);
+
+    // Add samples [first, last) of the pixels in a row whose mask is set, or all of them
+    auto drawSamples = [&](int y, int first, int last, const uint8_t *pMask) {
+        if (!region.Empty() && (y < region.y0 || y >= region.y1))
+        {
+            return;
+        }
+
+        thread_local std::vector<vec3> rowRays;
+        rowRays.resize(ImageWidth * numSamples);
+        auto &sampler = Sampler::ForThread();
+
+        // Camera rays for the whole row, a sample position at a time
+        if (!useSampler)
+        {
+            for (auto i = first; i < last; i++)
+            {
+                vec2 sampleOffset = filter.Offset(SamplePatterns[i]);
+                pCamera->GetWorldRays(vec2(0.5f + sampleOffset.x, float(y) + 0.5f + sampleOffset.y), ImageWidth, &rowRays[i * ImageWidth]);
+            }
+        }
+
+        for (int x = 0; x < ImageWidth; x++)
+        {
+            if ((pMask && !pMask[x]) || !inRegion(x, y))
+            {
+                continue;
+            }
+
+            auto index = y * ImageWidth + x;
+            for (auto i = first; i < last; i++)
+            {
+                vec2 sampleOffset;
+                vec3 raydir;
+                if (useSampler)
+                {
+                    sampler.Start(samplerType, uint32_t(index), uint32_t(i), uint32_t(numSamples));
+                    sampleOffset = filter.Offset(sampler.Get2D());
+                    raydir = pCamera->GetWorldRay(vec2(float(x) + 0.5f + sampleOffset.x, float(y) + 0.5f + sampleOffset.y));
+                }
+                else
+                {
+                    sampleOffset = filter.Offset(SamplePatterns[i]);
+                    raydir = rowRays[i * ImageWidth + x];
+                }
+
+                // The first sample's camera ray is traced once, and its hit kept for finding edges
+                float weight = filter.Weight(sampleOffset);
+                if (edgesOnly && i == 0)
+                {
+                    HitRecord firstHit;
+                    sums[index] += vec4(traceRay(pCamera->position, raydir, &firstHit) * weight, weight);
+                    primaryHits[index] = ToPrimaryHit(firstHit, pCamera->position, raydir);
+                }
+                else
+                {
+                    sums[index] += vec4(traceRay(pCamera->position, raydir, nullptr) * weight, weight);
+                }
+            }
+        }
+    };
+
+    ForEachRow(partitions, [&](int y) {
+        drawSamples(y, 0, edgesOnly ? 1 : numSamples, nullptr);
+    });
+
+    if (edgesOnly)
+    {
+        // Pixels that differ from any of their neighbours in the region get the rest
+        std::atomic<int> edgePixels{0};
+        ForEachRow(partitions, [&](int y) {
+            std::vector<uint8_t> mask(ImageWidth, 0);
+            int rowEdges = 0;
+            for (int x = 0; x < ImageWidth; x++)
+            {
+                const auto &hit = primaryHits[y * ImageWidth + x];
+                bool edge = (x > 0 && inRegion(x - 1, y) && IsGeometricEdge(hit, primaryHits[y * ImageWidth + x - 1])) ||
+                            (x + 1 < ImageWidth && inRegion(x + 1, y) && IsGeometricEdge(hit, primaryHits[y * ImageWidth + x + 1])) ||
+                            (y > 0 && inRegion(x, y - 1) && IsGeometricEdge(hit, primaryHits[(y - 1) * ImageWidth + x])) ||
+                            (y + 1 < ImageHeight && inRegion(x, y + 1) && IsGeometricEdge(hit, primaryHits[(y + 1) * ImageWidth + x]));
+                edge = edge && inRegion(x, y);
+                mask[x] = edge ? 1 : 0;
+                rowEdges += edge ? 1 : 0;
+            }
+            edgePixels += rowEdges;
+            drawSamples(y, 1, numSamples, mask.data());
+        });
+        std::cout << "Edge pixels: " << edgePixels << " (" << (edgePixels * 100 / (ImageWidth * ImageHeight)) << "%)" << std::endl;
+    }
+
+    for (int y = 0; y < ImageHeight; y++)
+    {
+        for (int x = 0; x < ImageWidth; x++)
+        {
+            if (!inRegion(x, y))
+            {
+                continue;
+            }
+
+            const vec4 &sum = sums[y * ImageWidth + x];
+            vec3 color = vec3(sum) * (sum.w > 0.0f ? 1.0f / sum.w : 0.0f);
+
+            // Color might have maxed out, so clamp.
+            color = color * 255.0f;
+            color = clamp(color, vec3(0.0f, 0.0f, 0.0f), vec3(255.0f, 255.0f, 255.0f));
+
+            PutPixel(pBitmap, x, y, Color{uint8_t(color.x), uint8_t(color.y), uint8_t(color.z)});
+        }
+    }
+}
+
+// The primitive types the specialised kernel is built for
+using SpecializedScene = StaticScene<Sphere, TiledPlane>;
+using SpecializedRenderer = StaticRenderer<MAX_DEPTH, PhongShading<10>, Sphere, TiledPlane>;
+
+// Render with the wavefront engine, all paths moving forward a stage at a time
+void DrawSceneWavefront(Bitmap *pBitmap, int partitions, int numSamples, bool sortRays)
+{
+    std::vector<vec2> pattern(SamplePatterns, SamplePatterns + std::min(numSamples, SamplePatternSize));
+    std::vector<vec3> image;
+    WavefrontRenderer renderer(sceneObjects, materials, pathSettings, BackgroundColor, MAX_DEPTH, partitions, sortRays);
+    renderer.Render(*pCamera, ImageWidth, ImageHeight, pattern, image);
+
+    for (int y = 0; y < ImageHeight; y++)
+    {
+        for (int x = 0; x < ImageWidth; x++)
+        {
+            // Color might have maxed out, so clamp.
+            vec3 color = image[y * ImageWidth + x] * 255.0f;
+            color = clamp(color, vec3(0.0f, 0.0f, 0.0f), vec3(255.0f, 255.0f, 255.0f));
+
+            PutPixel(pBitmap, x, y, Color{uint8_t(color.x), uint8_t(color.y), uint8_t(color.z)});
+        }
+    }
+}
+
+void DrawScene(Bitmap *pBitmap, int partitions, int numSamples, bool edgesOnly, bool useSampler, const PixelFilter &filter, const PixelRect &region, bool specialized, bool wavefront, bool sortRays, IntegratorType integratorType)
+{
+    // Only the generic kernel samples lights, or renders anything but Whitted
+    if (lightSamples > 0 || integratorType != IntegratorType::Whitted)
+    {
+        specialized = false;
+        wavefront = false;
+    }
+
+    if (wavefront)
+    {
+        std::cout << "Kernel: wavefront" << (sortRays ? ", sorted rays" : "") << std::endl;
+        DrawSceneWavefront(pBitmap, partitions, numSamples, sortRays);
+        return;
+    }
+
+    // Use the compile time kernel if the scene only has types it knows about
+    SpecializedScene staticScene;
+    if (specialized && staticScene.Build(sceneObjects))
+    {
+        std::cout << "Kernel: specialized" << std::endl;
+        DrawSceneWith(pBitmap, partitions, numSamples, edgesOnly, useSampler, filter, region, SpecializedRenderer(staticScene, materials, pathSettings, BackgroundColor));
+        return;
+    }
+
+    std::cout << "Kernel: generic" << std::endl;
+    auto pIntegrator = CreateIntegrator(integratorType);
+    DrawSceneWith(pBitmap, partitions, numSamples, edgesOnly, useSampler, filter, region, [&](const vec3 &rayorig, const vec3 &raydir, HitRecord *pFirstHit) {
+        return pIntegrator->Trace(rayorig, raydir, pFirstHit);
+    });
+}
+
 void main(int argc, char **args)
 {
     cli::Parser parser(argc, args);
     parser.set_optional<int>("p", "partitions", 2, "thread partitions 2 == 4, 3 == 9");
-    parser.set_optional<int>("a", "antialiased", 1, "Antialias each pixel");
+    parser.set_optional<int>("a", "antialiased", 1, "Antialias: 0 off, 1 every pixel, 2 only pixels on geometric edges (not the wavefront engine)");
+    parser.set_optional<int>("n", "samples", 4, "Samples per pixel when antialiasing (at most 4 with the fixed pattern and the wavefront engine)");
+    parser.set_optional<std::string>("b", "filter", "box", "Pixel filter: box, tent or blackmanharris (the wavefront engine always uses box)");
+    parser.set_optional<std::string>("g", "region", "", "Only render the pixels in x0,y0,x1,y1 (not the wavefront engine)");
+    parser.set_optional<int>("d", "displaced", 0, "Add a lazily tessellated displacement surface to the scene");
+    parser.set_optional<int>("f", "fields", 0, "Add signed distance field objects to the scene");
+    parser.set_optional<int>("m", "mirrors", 0, "Add a field of small reflective balls to the scene");
+    parser.set_optional<int>("e", "emitters", 0, "Add this many small lights to the scene");
+    parser.set_optional<int>("l", "lightsamples", 0, "Lights to sample from the light tree at each hit, or 0 to shade every light (generic kernel only)");
+    parser.set_optional<int>("c", "occludercache", 1, "Test the last object to shadow each light first (generic kernel only)");
+    parser.set_optional<int>("k", "kernel", 1, "Use the compile time specialized kernel when the scene allows it");
+    parser.set_optional<int>("w", "wavefront", 0, "Trace with the wavefront (stream) engine instead of pixel by pixel");
+    parser.set_optional<int>("s", "sort", 0, "Bucket secondary and shadow rays by direction and origin before tracing (wavefront only)");
+    parser.set_optional<float>("t", "throughput", 1.0f / 512.0f, "Stop following reflections once their weight is below this");
+    parser.set_optional<int>("r", "roulette", 0, "Russian roulette on weak reflections instead of stopping them");
+    parser.set_optional<std::string>("i", "integrator", "whitted", "Render mode: " + IntegratorNameList() + " (all but whitted use the generic kernel)");
+    parser.set_optional<std::string>("q", "sampler", "sobol", "Sample points: sobol, stratified, random, or pattern for the fixed antialiasing pattern and random numbers (the wavefront engine always uses the pattern)");
+    parser.set_optional<int>("o", "aosamples", 4, "Rays cast from each hit in the ao mode");
+    parser.set_optional<float>("h", "aodistance", 1.5f, "How far the ao rays look for occluders");
     parser.run();
 
     auto partitions = parser.get<int>("p");
     auto antialias = parser.get<int>("a");
+    auto displaced = parser.get<int>("d");
+    auto distanceFields = parser.get<int>("f");
+    auto mirrors = parser.get<int>("m");
+    auto extraLights = parser.get<int>("e");
+    lightSamples = parser.get<int>("l");
+    useOccluderCache = parser.get<int>("c") == 1 ? true : false;
+    auto specialized = parser.get<int>("k");
+    auto wavefront = parser.get<int>("w");
+    auto sortRays = parser.get<int>("s");
+    pathSettings.throughputCutoff = parser.get<float>("t");
+    pathSettings.russianRoulette = parser.get<int>("r") == 1 ? true : false;
+    ambientOcclusionSamples = std::max(1, parser.get<int>("o"));
+    ambientOcclusionDistance = parser.get<float>("h");
+
+    auto samplerName = parser.get<std::string>("q");
+    if (samplerName != "sobol" && samplerName != "stratified" && samplerName != "random" && samplerName != "pattern")
+    {
+        std::cout << "Unknown sampler: " << samplerName << ", expected sobol, stratified, random or pattern" << std::endl;
+        return;
+    }
+    bool useSampler = samplerName != "pattern";
+    samplerType = samplerName == "random" ? SamplerType::Random : (samplerName == "stratified" ? SamplerType::Stratified : SamplerType::Sobol);
+
+    int numSamples = antialias != 0 ? std::max(1, parser.get<int>("n")) : 1;
+    if (!useSampler && numSamples > SamplePatternSize)
+    {
+        std::cout << "The fixed pattern has " << SamplePatternSize << " samples" << std::endl;
+        numSamples = SamplePatternSize;
+    }
+
+    FilterType filterType;
+    if (!FindFilter(parser.get<std::string>("b"), filterType))
+    {
+        std::cout << "Unknown filter: " << parser.get<std::string>("b") << ", expected box, tent or blackmanharris" << std::endl;
+        return;
+    }
+
+    PixelRect region;
+    if (!parser.get<std::string>("g").empty() && !ParseRegion(parser.get<std::string>("g"), region))
+    {
+        std::cout << "Bad region: " << parser.get<std::string>("g") << ", expected x0,y0,x1,y1" << std::endl;
+        return;
+    }
+
+    IntegratorType integratorType;
+    if (!FindIntegrator(parser.get<std::string>("i"), integratorType))
+    {
+        std::cout << "Unknown integrator: " << parser.get<std::string>("i") << ", expected one of " << IntegratorNameList() << std::endl;
+        return;
+    }
 
     Bitmap *pBitmap = CreateBitmap(ImageWidth, ImageHeight);
 
     Color col{127, 127, 127};
     ClearBitmap(pBitmap, col);
 
-    InitScene();
+    InitScene(displaced == 1 ? true : false, distanceFields == 1 ? true : false, mirrors == 1 ? true : false, extraLights);
     auto start = std::chrono::high_resolution_clock::now();
 
-    DrawScene(pBitmap, partitions, antialias == 1 ? true : false);
+    DrawScene(pBitmap, partitions, numSamples, antialias == 2, useSampler, PixelFilter(filterType), region, specialized == 1 ? true : false, wavefront == 1 ? true : false, sortRays == 1 ? true : false, integratorType);
 
     auto end = std::chrono::high_resolution_clock::now();
     auto diff = end - start;
 
     std::cout << "Time: " << std::chrono::duration<double, std::milli>(diff).count() << " ms" << std::endl;
+    if (pTessellationCache)
+    {
+        pTessellationCache->PrintStats();
+    }
+    auto &occluderStats = GetOccluderCacheStats();
+    if (occluderStats.hits + occluderStats.misses + occluderStats.unoccluded > 0)
+    {
+        std::cout << "Occluder cache: " << occluderStats.hits << " hits, " << occluderStats.misses << " misses, " << occluderStats.unoccluded << " unoccluded ("
+                  << int(occluderStats.HitRate() * 100.0) << "% of shadowed rays)" << std::endl;
+    }
     WriteBitmap(pBitmap, "image.bmp");
     DestroyBitmap(pBitmap);
 
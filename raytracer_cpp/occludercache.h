@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+
+// Shadow occluder cache.
+// Neighbouring shading points usually find the same object between them and a light, so each thread remembers,
+// for every light, the last object that blocked a shadow ray to it, and tests that first.  In shadowed regions
+// the full any-hit loop is then mostly skipped.
+// Counts are kept per thread and added to the shared totals when the thread ends, so the cache costs no
+// synchronization while rendering.
+
+struct OccluderCacheStats
+{
+    std::atomic<uint64_t> hits{ 0 };        // The remembered object blocked the ray
+    std::atomic<uint64_t> misses{ 0 };      // Something else did, found by the full test
+    std::atomic<uint64_t> unoccluded{ 0 };  // Nothing did
+
+    void Reset()
+    {
+        hits = 0;
+        misses = 0;
+        unoccluded = 0;
+    }
+
+    // Of the shadow rays that were blocked, the fraction the cache answered
+    double HitRate() const
+    {
+        uint64_t occluded = hits + misses;
+        return occluded == 0 ? 0.0 : double(hits) / double(occluded);
+    }
+};
+
+inline OccluderCacheStats& GetOccluderCacheStats()
+{
+    static OccluderCacheStats stats;
+    return stats;
+}
+
+class OccluderCache
+{
+public:
+    ~OccluderCache()
+    {
+        auto& stats = GetOccluderCacheStats();
+        stats.hits += hits;
+        stats.misses += misses;
+        stats.unoccluded += unoccluded;
+    }
+
+    // The calling thread's cache
+    static OccluderCache& ForThread()
+    {
+        thread_local OccluderCache cache;
+        return cache;
+    }
+
+    // The last object to block a ray to this light, or NoPrimitive
+    uint32_t Get(uint32_t lightId) const
+    {
+        return lightId < occluders.size() ? occluders[lightId] : NoPrimitive;
+    }
+
+    void Set(uint32_t lightId, uint32_t occluderId)
+    {
+        if (lightId >= occluders.size())
+        {
+            occluders.resize(lightId + 1, NoPrimitive);
+        }
+        occluders[lightId] = occluderId;
+    }
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t unoccluded = 0;
+
+private:
+    std::vector<uint32_t> occluders;    // Indexed by light
+};
@@ -0,0 +1,229 @@
+#pragma once
+
+// Pieces of the path tracing integrator.
+// Materials are read as a physically based reflection model: a perfect mirror for 'reflectance' of the light,
+// and for the rest a Lambertian lobe from 'albedo' plus a normalized Phong lobe, of the same exponent as the
+// Whitted shading, from 'specular'.  Directions are importance sampled from the lobes, and direct light is also
+// sampled from the emitters (next event estimation); each estimate is weighted by multiple importance sampling,
+// so whichever technique suits a light path better dominates.
+
+const float Pi = 3.14159265358979f;
+
+// Orthonormal basis around a unit vector
+inline void BuildBasis(const vec3& w, vec3& u, vec3& v)
+{
+    u = glm::normalize(glm::cross(std::abs(w.x) > 0.9f ? vec3(0.0f, 1.0f, 0.0f) : vec3(1.0f, 0.0f, 0.0f), w));
+    v = glm::cross(w, u);
+}
+
+// The direction at angle theta from the axis, turned by phi about it
+inline vec3 DirectionAround(const vec3& axis, float cosTheta, float phi)
+{
+    vec3 u;
+    vec3 v;
+    BuildBasis(axis, u, v);
+    float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+    return glm::normalize(u * (std::cos(phi) * sinTheta) + v * (std::sin(phi) * sinTheta) + axis * cosTheta);
+}
+
+// Balance the techniques: the power heuristic with beta = 2
+inline float PowerHeuristic(float pdf, float otherPdf)
+{
+    float a = pdf * pdf;
+    float b = otherPdf * otherPdf;
+    return (a + b) > 0.0f ? a / (a + b) : 0.0f;
+}
+
+inline float Luminance(const vec3& color)
+{
+    return glm::dot(color, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// The reflection model of a material at a shading point
+struct PhongBsdf
+{
+    static const int Exponent = 10;
+
+    vec3 normal;
+    vec3 reflect;              // Mirror direction of the incoming ray
+    vec3 diffuse;              // Lobe colors, already scaled by the non mirror share
+    vec3 specular;
+    float reflectance;              // Share of the light the mirror takes
+    float mirrorChance;             // Chance of following the mirror rather than sampling the lobes
+    float diffuseChance;            // Chance of the diffuse lobe, when sampling the lobes
+
+    PhongBsdf(const Material& material, const vec3& n, const vec3& r)
+        : normal(n),
+        reflect(r),
+        reflectance(material.reflectance)
+    {
+        diffuse = material.albedo * (1.0f - material.reflectance);
+        specular = material.specular * (1.0f - material.reflectance);
+
+        float diffuseWeight = Luminance(diffuse);
+        float specularWeight = Luminance(specular);
+        float total = diffuseWeight + specularWeight;
+        mirrorChance = total > 0.0f ? material.reflectance : (material.reflectance > 0.0f ? 1.0f : 0.0f);
+        diffuseChance = total > 0.0f ? diffuseWeight / total : 1.0f;
+    }
+
+    // Reflected radiance per unit incoming, for light arriving from wi (excluding the mirror)
+    vec3 Evaluate(const vec3& wi) const
+    {
+        if (glm::dot(normal, wi) <= 0.0f)
+        {
+            return vec3(0.0f);
+        }
+        float cosAlpha = std::max(0.0f, glm::dot(reflect, wi));
+        return diffuse * (1.0f / Pi) + specular * ((Exponent + 2.0f) / (2.0f * Pi) * std::pow(cosAlpha, float(Exponent)));
+    }
+
+    // Solid angle density of Sample choosing wi from the lobes (excluding the mirror)
+    float Pdf(const vec3& wi) const
+    {
+        float cosTheta = glm::dot(normal, wi);
+        if (cosTheta <= 0.0f)
+        {
+            return 0.0f;
+        }
+        float cosAlpha = std::max(0.0f, glm::dot(reflect, wi));
+        float lobes = diffuseChance * cosTheta / Pi +
+            (1.0f - diffuseChance) * (Exponent + 1.0f) / (2.0f * Pi) * std::pow(cosAlpha, float(Exponent));
+        return (1.0f - mirrorChance) * lobes;
+    }
+
+    // Choose the next direction, from a uniform sample for the lobe and a uniform point for the direction.
+    // Returns the path weight (f * cos / pdf), or zero if the path should end.
+    // 'mirror' is set when the perfect mirror was chosen; its pdf is a delta, so it takes no part in MIS
+    vec3 Sample(float lobeSample, const vec2& directionSample, vec3& wi, float& pdf, bool& mirror) const
+    {
+        mirror = lobeSample < mirrorChance;
+        if (mirror)
+        {
+            wi = reflect;
+            pdf = 0.0f;
+            return vec3(reflectance / mirrorChance);
+        }
+
+        // The rest of the lobe sample picks between the other two
+        float u1 = directionSample.x;
+        float u2 = directionSample.y;
+        if ((lobeSample - mirrorChance) < diffuseChance * (1.0f - mirrorChance))
+        {
+            // Cosine weighted about the normal
+            wi = DirectionAround(normal, std::sqrt(1.0f - u1), 2.0f * Pi * u2);
+        }
+        else
+        {
+            // Phong lobe about the mirror direction
+            wi = DirectionAround(reflect, std::pow(1.0f - u1, 1.0f / (Exponent + 1.0f)), 2.0f * Pi * u2);
+        }
+
+        pdf = Pdf(wi);
+        if (pdf <= 0.0f)
+        {
+            return vec3(0.0f);
+        }
+        return Evaluate(wi) * glm::dot(normal, wi) / pdf;
+    }
+};
+
+// The emissive spheres, for next event estimation, picked in proportion to their power
+class EmitterSampler
+{
+public:
+    void Build(const std::vector<std::shared_ptr<SceneObject>>& objects, const MaterialTable& materials)
+    {
+        emitters.clear();
+        chance.assign(objects.size(), 0.0f);
+
+        float totalPower = 0.0f;
+        for (uint32_t id = 0; id < uint32_t(objects.size()); id++)
+        {
+            auto pSphere = dynamic_cast<const Sphere*>(objects[id].get());
+            if (pSphere && materials[pSphere->material].emissive != vec3(0.0f))
+            {
+                float power = Luminance(materials[pSphere->material].emissive) * pSphere->radius * pSphere->radius;
+                emitters.push_back({ id, pSphere, power });
+                totalPower += power;
+            }
+        }
+
+        for (auto& emitter : emitters)
+        {
+            emitter.power /= totalPower;
+            chance[emitter.id] = emitter.power;
+        }
+    }
+
+    bool Empty() const
+    {
+        return emitters.empty();
+    }
+
+    // Choose an emitter with a uniform sample, and a direction towards it from pos, uniformly within the cone it
+    // fills, with a uniform point.  Returns false if pos is inside it
+    bool Sample(const vec3& pos, float emitterSample, const vec2& directionSample, uint32_t& emitterId, vec3& wi, float& pdf) const
+    {
+        float u = emitterSample;
+        size_t index = 0;
+        while (index + 1 < emitters.size() && u >= emitters[index].power)
+        {
+            u -= emitters[index].power;
+            index++;
+        }
+
+        const Sphere* pSphere = emitters[index].pSphere;
+        float coneHeight;
+        if (!ConeTo(*pSphere, pos, coneHeight))
+        {
+            return false;
+        }
+
+        emitterId = emitters[index].id;
+        wi = DirectionAround(glm::normalize(pSphere->center - pos), 1.0f - directionSample.x * coneHeight, 2.0f * Pi * directionSample.y);
+        pdf = emitters[index].power / (2.0f * Pi * coneHeight);
+        return true;
+    }
+
+    // Solid angle density of Sample choosing a direction from pos that reaches the given object
+    float Pdf(uint32_t objectId, const SceneObject* pObject, const vec3& pos) const
+    {
+        if (objectId >= chance.size() || chance[objectId] <= 0.0f)
+        {
+            return 0.0f;
+        }
+
+        float coneHeight;
+        if (!ConeTo(*static_cast<const Sphere*>(pObject), pos, coneHeight))
+        {
+            return 0.0f;
+        }
+        return chance[objectId] / (2.0f * Pi * coneHeight);
+    }
+
+private:
+    // 1 - cos of the half angle of the cone a sphere fills, seen from pos; the solid angle over 2 pi.
+    // Written so it doesn't round to zero for far away spheres
+    static bool ConeTo(const Sphere& sphere, const vec3& pos, float& coneHeight)
+    {
+        float distanceSq = glm::dot(sphere.center - pos, sphere.center - pos);
+        float radiusSq = sphere.radius * sphere.radius;
+        if (distanceSq <= radiusSq)
+        {
+            return false;
+        }
+        float sinSq = radiusSq / distanceSq;
+        coneHeight = sinSq / (1.0f + std::sqrt(1.0f - sinSq));
+        return true;
+    }
+
+    struct Emitter
+    {
+        uint32_t id;
+        const Sphere* pSphere;
+        float power;                // Normalized: the chance of picking it
+    };
+    std::vector<Emitter> emitters;
+    std::vector<float> chance;      // Indexed by scene object
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include <cstdio>
+
+// Render regions.
+// A region limits tracing to a rectangle of the image, so working on one object doesn't pay for the whole
+// frame; pixels outside it are left as the bitmap was cleared.
+
+// [x0, x1) by [y0, y1), in pixels
+struct PixelRect
+{
+    int x0 = 0;
+    int y0 = 0;
+    int x1 = 0;
+    int y1 = 0;
+
+    bool Empty() const
+    {
+        return x1 <= x0 || y1 <= y0;
+    }
+
+    bool Contains(int x, int y) const
+    {
+        return x >= x0 && y >= y0 && x < x1 && y < y1;
+    }
+};
+
+// A rectangle written as "x0,y0,x1,y1".  Fails if it isn't one
+inline bool ParseRegion(const std::string& text, PixelRect& rect)
+{
+    PixelRect parsed;
+    if (std::sscanf(text.c_str(), "%d,%d,%d,%d", &parsed.x0, &parsed.y0, &parsed.x1, &parsed.y1) != 4 || parsed.Empty())
+    {
+        return false;
+    }
+    rect = parsed;
+    return true;
+}
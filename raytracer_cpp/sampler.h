@@ -0,0 +1,213 @@
+#pragma once
+
+// Sample points for everything a pixel sample decides at random: where in the pixel it goes, where on the lens
+// it starts, which light it picks and which way it bounces.
+// With the Sobol sampler these are Owen-scrambled Sobol points, made per pixel and per dimension by hashing
+// (Burley, 'Practical Hash-based Owen Scrambling', 2020).  The first n samples of a pixel are then spread
+// evenly in each dimension, and across each pair of dimensions drawn together, so error falls faster with the
+// sample count than with independent random numbers.  Each pixel is scrambled differently, so the pattern
+// doesn't repeat across the image.
+// The stratified sampler needs to know how many samples the pixel will take.  It makes jittered points that
+// are stratified on a grid of that many cells and in each axis on its own (Kensler, 'Correlated Multi-Jittered
+// Sampling', 2013), and is as good as Sobol for the first couple of dimensions at a fixed count.
+// Callers draw dimensions in order after Start; a sample that draws the same things in the same order as
+// another gets the same dimensions, so paths stay stratified against each other bounce by bounce.
+
+enum class SamplerType
+{
+    Random,     // Independent uniform numbers
+    Sobol,      // Owen-scrambled Sobol points
+    Stratified  // Correlated multi-jittered points, for a known sample count
+};
+
+class Sampler
+{
+public:
+    // The calling thread's sampler
+    static Sampler& ForThread()
+    {
+        thread_local Sampler sampler;
+        return sampler;
+    }
+
+    // Begin a pixel's sampleIndex'th sample of sampleCount; dimensions count from 0 again.  The count is only
+    // needed by the stratified sampler
+    void Start(SamplerType samplerType, uint32_t pixel, uint32_t sampleIndex, uint32_t sampleCount = 0)
+    {
+        type = samplerType;
+        if (type == SamplerType::Stratified && sampleCount == 0)
+        {
+            type = SamplerType::Random;
+        }
+        seed = Hash(pixel);
+        index = sampleIndex;
+        count = sampleCount;
+        dimension = 0;
+    }
+
+    float Get1D()
+    {
+        if (type == SamplerType::Random)
+        {
+            return RandomFloat();
+        }
+
+        if (type == SamplerType::Stratified)
+        {
+            // A stratum each, in a shuffled order
+            uint32_t dimensionSeed = Hash(seed ^ Hash(dimension++));
+            return (float(Permute(index, count, dimensionSeed)) + JitterFloat(index, dimensionSeed * 0x967a889bu)) / float(count);
+        }
+
+        uint32_t dimensionSeed = Hash(seed ^ Hash(dimension++));
+        return ToFloat(Scramble(ReverseBits(ShuffledIndex(dimensionSeed)), Hash(dimensionSeed)));
+    }
+
+    // Two dimensions that are stratified against each other, as well as on their own
+    vec2 Get2D()
+    {
+        if (type == SamplerType::Random)
+        {
+            float x = RandomFloat();
+            return vec2(x, RandomFloat());
+        }
+
+        uint32_t dimensionSeed = Hash(seed ^ Hash(dimension++));
+        if (type == SamplerType::Stratified)
+        {
+            return CorrelatedMultiJittered(dimensionSeed);
+        }
+
+        uint32_t shuffled = ShuffledIndex(dimensionSeed);
+        return vec2(ToFloat(Scramble(ReverseBits(shuffled), Hash(dimensionSeed ^ 0x5bd1e995u))),
+            ToFloat(Scramble(SobolSecondDimension(shuffled), Hash(dimensionSeed ^ 0x68e31da4u))));
+    }
+
+private:
+    // Samples are taken in a different order in each dimension, so dimensions don't correlate
+    uint32_t ShuffledIndex(uint32_t dimensionSeed) const
+    {
+        return Scramble(index, dimensionSeed);
+    }
+
+    // Point 'index' of 'count', on a grid of about sqrt(count) columns and rows.  Each point is in its own cell
+    // and its own stratum of count along y; when count is a square, also along x
+    vec2 CorrelatedMultiJittered(uint32_t pattern) const
+    {
+        uint32_t columns = std::max(1u, uint32_t(std::sqrt(float(count))));
+        uint32_t rows = (count + columns - 1) / columns;
+        uint32_t s = Permute(index, count, pattern * 0x51633e2du);
+        uint32_t sx = Permute(s % columns, columns, pattern * 0x68bc21ebu);
+        uint32_t sy = Permute(s / columns, rows, pattern * 0x02e5be93u);
+        float jx = JitterFloat(s, pattern * 0x967a889bu);
+        float jy = JitterFloat(s, pattern * 0x368cc8b7u);
+        return vec2((float(sx) + (float(sy) + jx) / float(rows)) / float(columns), (float(s) + jy) / float(count));
+    }
+
+    // A random permutation of [0, length), chosen by the pattern, applied to i (Kensler)
+    static uint32_t Permute(uint32_t i, uint32_t length, uint32_t pattern)
+    {
+        uint32_t w = length - 1;
+        w |= w >> 1;
+        w |= w >> 2;
+        w |= w >> 4;
+        w |= w >> 8;
+        w |= w >> 16;
+        do
+        {
+            i ^= pattern;
+            i *= 0xe170893du;
+            i ^= pattern >> 16;
+            i ^= (i & w) >> 4;
+            i ^= pattern >> 8;
+            i *= 0x0929eb3fu;
+            i ^= pattern >> 23;
+            i ^= (i & w) >> 1;
+            i *= 1 | pattern >> 27;
+            i *= 0x6935fa69u;
+            i ^= (i & w) >> 11;
+            i *= 0x74dcb303u;
+            i ^= (i & w) >> 2;
+            i *= 0x9e501cc3u;
+            i ^= (i & w) >> 2;
+            i *= 0xc860a3dfu;
+            i &= w;
+            i ^= i >> 5;
+        } while (i >= length);
+        return (i + pattern) % length;
+    }
+
+    // A hashed float in [0, 1), for the jitter within a stratum
+    static float JitterFloat(uint32_t i, uint32_t pattern)
+    {
+        i ^= pattern;
+        i ^= i >> 17;
+        i ^= i >> 10;
+        i *= 0xb36534e5u;
+        i ^= i >> 12;
+        i ^= i >> 21;
+        i *= 0x93fc4795u;
+        i ^= 0xdf6e307fu;
+        i ^= i >> 17;
+        i *= 1 | pattern >> 18;
+        return ToFloat(i);
+    }
+
+    // The second Sobol dimension; the first is the index with its bits reversed
+    static uint32_t SobolSecondDimension(uint32_t i)
+    {
+        uint32_t result = 0;
+        for (uint32_t v = 1u << 31; i != 0; i >>= 1, v ^= v >> 1)
+        {
+            if (i & 1)
+            {
+                result ^= v;
+            }
+        }
+        return result;
+    }
+
+    // Nested uniform (Owen) scrambling: every bit is flipped depending on the bits above it.  Done as a hash
+    // that only carries upwards, applied to the reversed bits (Laine and Karras)
+    static uint32_t Scramble(uint32_t x, uint32_t scrambleSeed)
+    {
+        x = ReverseBits(x);
+        x += scrambleSeed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return ReverseBits(x);
+    }
+
+    static uint32_t ReverseBits(uint32_t x)
+    {
+        x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+        x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+        x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+        x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    static uint32_t Hash(uint32_t x)
+    {
+        x ^= x >> 16;
+        x *= 0x7feb352du;
+        x ^= x >> 15;
+        x *= 0x846ca68bu;
+        x ^= x >> 16;
+        return x;
+    }
+
+    // The top 24 bits, as a float in [0, 1)
+    static float ToFloat(uint32_t x)
+    {
+        return float(x >> 8) * (1.0f / 16777216.0f);
+    }
+
+    SamplerType type = SamplerType::Random;
+    uint32_t seed = 0;
+    uint32_t index = 0;
+    uint32_t count = 0;
+    uint32_t dimension = 0;
+};
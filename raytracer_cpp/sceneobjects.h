@@ -2,61 +2,236 @@
 
 struct Material
 {
-    vec3 albedo;        // Base color of the surface
-    vec3 specular;      // Specular reflection color
-    float reflectance;  // How reflective the surface is
-    vec3 emissive;      // Light that the material emits
+    vec3 albedo = vec3(0.0f);      // Base color of the surface
+    vec3 specular = vec3(0.0f);    // Specular reflection color
+    float reflectance = 0.0f;      // How reflective the surface is
+    vec3 emissive = vec3(0.0f);    // Light that the material emits
+
+    bool operator == (const Material& rhs) const
+    {
+        return albedo == rhs.albedo &&
+            specular == rhs.specular &&
+            reflectance == rhs.reflectance &&
+            emissive == rhs.emissive;
+    }
+};
+
+// Index of a material in the MaterialTable
+using MaterialId = uint16_t;
+
+// Every distinct material in the scene, stored once.  Objects only hold a compact index, and the material
+// itself is looked up once the closest hit is known
+struct MaterialTable
+{
+    std::vector<Material> materials;
+
+    // Returns the index of an identical material if we already have one
+    MaterialId Add(const Material& mat)
+    {
+        auto itr = std::find(materials.begin(), materials.end(), mat);
+        if (itr != materials.end())
+        {
+            return MaterialId(itr - materials.begin());
+        }
+        assert(materials.size() < std::numeric_limits<MaterialId>::max());
+        materials.push_back(mat);
+        return MaterialId(materials.size() - 1);
+    }
+
+    const Material& operator[](MaterialId id) const
+    {
+        return materials[id];
+    }
+
+    void Clear()
+    {
+        materials.clear();
+    }
 };
 
 enum class SceneObjectType
 {
     Sphere,
-    Plane
+    Plane,
+    Surface,
+    Sdf
+};
+
+// An axis aligned box, used to cheaply reject rays before doing the real intersection work
+struct BoundingBox
+{
+    vec3 min = vec3(std::numeric_limits<float>::max());
+    vec3 max = vec3(-std::numeric_limits<float>::max());
+
+    void Extend(const vec3& point)
+    {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+
+    void Extend(const BoundingBox& box)
+    {
+        min = glm::min(min, box.min);
+        max = glm::max(max, box.max);
+    }
+
+    vec3 Center() const
+    {
+        return (min + max) * 0.5f;
+    }
+
+    // How far a point is from the box; 0 inside it
+    float DistanceTo(const vec3& point) const
+    {
+        return glm::length(glm::max(glm::max(min - point, point - max), vec3(0.0f)));
+    }
+
+    // Slab test against a ray given as origin and 1/direction.  Returns the distances the ray enters and leaves
+    // the box; entry is 0 if it starts inside
+    bool Clip(const vec3& rayOrigin, const vec3& invRayDir, float& entry, float& exit) const
+    {
+        vec3 t0 = (min - rayOrigin) * invRayDir;
+        vec3 t1 = (max - rayOrigin) * invRayDir;
+        vec3 tNear = glm::min(t0, t1);
+        vec3 tFar = glm::max(t0, t1);
+        entry = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+        exit = std::min(std::min(tFar.x, tFar.y), tFar.z);
+        return entry <= exit;
+    }
+
+    // As above, but only hits closer than maxDistance count
+    bool Intersects(const vec3& rayOrigin, const vec3& invRayDir, float maxDistance, float& entry) const
+    {
+        float exit;
+        return Clip(rayOrigin, invRayDir, entry, exit) && entry <= maxDistance;
+    }
+};
+
+// Marks a hit record that hasn't hit anything
+const uint32_t NoPrimitive = 0xFFFFFFFF;
+
+// Everything we know about a ray hit before any shading is done.
+// Surface attributes (normal, material) are resolved from it afterwards, and only for the closest hit
+struct HitRecord
+{
+    uint32_t primitiveId = NoPrimitive;                 // Index of the object in the scene
+    float distance = std::numeric_limits<float>::max(); // Distance along the ray
+    uint32_t subPrimitive = 0;                          // For objects built from many pieces, the piece we hit
+    vec2 uv = vec2(0.0f);                           // Barycentrics or surface coordinates within that piece
 };
 
 struct SceneObject
 {
-    // Given a point on the surface, return the material at that point
-    virtual const Material& GetMaterial(const vec3& pos) const = 0;
+    // Given a hit on the surface, return the index of the material at that point
+    virtual MaterialId GetMaterialId(const HitRecord& hit, const vec3& pos) const = 0;
+
+    // Could any of the surface be emissive?  Objects that can't are never shaded as lights
+    virtual bool MayEmit(const MaterialTable& materials) const = 0;
 
     // Is it a sphere or a plane?
     virtual SceneObjectType GetSceneObjectType() const = 0;
 
-    // Given a point on the surface, return a normal
-    virtual vec3 GetSurfaceNormal(const vec3& pos) const = 0;
+    // Given a hit on the surface, return a normal
+    virtual vec3 GetSurfaceNormal(const HitRecord& hit, const vec3& pos) const = 0;
 
     // Given a source position, return a ray to this object's center
     virtual vec3 GetRayFrom(const vec3& from) const = 0;
 
-    // Intersect this object with a ray and figure out if it hits, and return the distance to the hit point 
-    virtual bool Intersects(const vec3& rayOrigin, const vec3& rayDir, float& distance) const = 0;
+    // Intersect this object with a ray and figure out if it hits; fill in the distance to the hit point and
+    // anything needed later to find the surface attributes there.  The primitive ID is left to the caller
+    virtual bool Intersects(const vec3& rayOrigin, const vec3& rayDir, HitRecord& hit) const = 0;
+
+    // Could any of the surface be within distance of pos?  Saying yes when it isn't is allowed, but not the
+    // reverse; short rays leaving pos can skip the objects that say no
+    virtual bool MayBeWithin(const vec3& pos, float distance) const
+    {
+        return true;
+    }
+};
+
+// A hit being shaded.  The normal and material are looked up from the hit record the first time the shader
+// asks for them, so shaders that don't need one never pay for it
+class ShadingPoint
+{
+public:
+    ShadingPoint(const SceneObject* pObj, const HitRecord& h, const vec3& rayOrigin, const vec3& rayDir)
+        : pObject(pObj),
+        hit(h),
+        position(rayOrigin + (rayDir * h.distance))
+    {
+    }
+
+    const HitRecord& GetHit() const
+    {
+        return hit;
+    }
+
+    const vec3& GetPosition() const
+    {
+        return position;
+    }
+
+    const vec3& GetNormal()
+    {
+        if (!hasNormal)
+        {
+            normal = pObject->GetSurfaceNormal(hit, position);
+            hasNormal = true;
+        }
+        return normal;
+    }
+
+    MaterialId GetMaterialId()
+    {
+        if (!hasMaterial)
+        {
+            material = pObject->GetMaterialId(hit, position);
+            hasMaterial = true;
+        }
+        return material;
+    }
+
+private:
+    const SceneObject* pObject;
+    HitRecord hit;
+    vec3 position;
+
+    vec3 normal;
+    MaterialId material = 0;
+    bool hasNormal = false;
+    bool hasMaterial = false;
 };
 
 // A sphere, at a coordinate, with a radius and a material
-struct Sphere : SceneObject
+struct Sphere final : SceneObject
 {
     vec3 center;
     float radius;
-    Material material;
+    MaterialId material;
 
-    Sphere(const Material& mat, const vec3& c, const float r)
+    Sphere(MaterialId mat, const vec3& c, const float r)
     {
         material = mat;
         center = c;
         radius = r;
     }
 
-    virtual const Material& GetMaterial(const vec3& pos) const override
+    virtual MaterialId GetMaterialId(const HitRecord& hit, const vec3& pos) const override
     {
         return material;
     }
 
+    virtual bool MayEmit(const MaterialTable& materials) const override
+    {
+        return materials[material].emissive != vec3(0.0f);
+    }
+
     virtual SceneObjectType GetSceneObjectType() const override
     {
         return SceneObjectType::Sphere;
     }
 
-    virtual vec3 GetSurfaceNormal(const vec3& pos) const
+    virtual vec3 GetSurfaceNormal(const HitRecord& hit, const vec3& pos) const
     {
         return normalize(pos - center);
     }
@@ -66,10 +241,14 @@ struct Sphere : SceneObject
         return normalize(center - from);
     }
 
-    virtual bool Intersects(const vec3& rayOrigin, const vec3& rayDir, float& distance) const
+    virtual bool MayBeWithin(const vec3& pos, float distance) const override
     {
-        bool hit = glm::intersectRaySphere(rayOrigin, glm::normalize(rayDir), center, radius * radius, distance);
-        return hit;
+        return glm::length(pos - center) - radius <= distance;
+    }
+
+    virtual bool Intersects(const vec3& rayOrigin, const vec3& rayDir, HitRecord& hit) const
+    {
+        return glm::intersectRaySphere(rayOrigin, glm::normalize(rayDir), center, radius * radius, hit.distance);
     }
 };
 
@@ -85,25 +264,20 @@ struct Plane : SceneObject
 };
 
 // A tiled plane.  returns a different material based on the hit point to represent the grid
-struct TiledPlane : Plane
+struct TiledPlane final : Plane
 {
-    Material blackMat;
-    Material whiteMat;
+    MaterialId blackMat;
+    MaterialId whiteMat;
 
-    TiledPlane(const vec3& o, const vec3& n)
+    TiledPlane(MaterialId black, MaterialId white, const vec3& o, const vec3& n)
     {
         normal = n;
         origin = o;
-        blackMat.reflectance = 0.6f;
-        blackMat.specular = vec3(0.0f, 0.0f, 0.0f);
-        blackMat.albedo = vec3(0.0f, 0.0f, 0.0f);
-
-        whiteMat.reflectance = 0.6f;
-        whiteMat.specular = vec3(1.0f, 1.0f, 1.0f);
-        whiteMat.albedo = vec3(1.0f, 1.0f, 1.0f);
+        blackMat = black;
+        whiteMat = white;
     }
 
-    virtual const Material& GetMaterial(const vec3& pos) const override
+    virtual MaterialId GetMaterialId(const HitRecord& hit, const vec3& pos) const override
     {
         bool white = ((int(floor(pos.x) + /*floor(pos.y) +*/ floor(pos.z)) & 1) == 0);
 
@@ -113,8 +287,13 @@ struct TiledPlane : Plane
         }
         return blackMat;
     }
+
+    virtual bool MayEmit(const MaterialTable& materials) const override
+    {
+        return materials[blackMat].emissive != vec3(0.0f) || materials[whiteMat].emissive != vec3(0.0f);
+    }
     
-    virtual vec3 GetSurfaceNormal(const vec3& pos) const
+    virtual vec3 GetSurfaceNormal(const HitRecord& hit, const vec3& pos) const
     {
         return normal;
     }
@@ -124,8 +303,13 @@ struct TiledPlane : Plane
         return normalize(origin - from);
     }
     
-    virtual bool Intersects(const vec3& rayOrigin, const vec3& rayDir, float& distance) const override
+    virtual bool MayBeWithin(const vec3& pos, float distance) const override
+    {
+        return std::abs(dot(pos - origin, normal)) <= distance;
+    }
+
+    virtual bool Intersects(const vec3& rayOrigin, const vec3& rayDir, HitRecord& hit) const override
     {
-        return glm::intersectRayPlane(rayOrigin, rayDir, origin, normal, distance);
+        return glm::intersectRayPlane(rayOrigin, rayDir, origin, normal, hit.distance);
     }
 };
\ No newline at end of file
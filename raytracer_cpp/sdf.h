@@ -0,0 +1,231 @@
+#pragma once
+
+// Signed distance field primitives.
+// Each one is sphere traced, but only between where the ray enters and leaves a tight bounding box, and for a
+// capped number of steps, so the cost per ray stays predictable however detailed the field is.
+// Steps are over-relaxed (Keinert et al, 'Enhanced Sphere Tracing'): we step further than the distance bound
+// allows, and if the next bound shows we jumped past the surface, we step back and continue unrelaxed.
+struct SdfObject : SceneObject
+{
+    MaterialId material;
+    BoundingBox bounds;
+
+    int maxSteps = 128;             // Give up (and miss) after this many steps
+    float overRelaxation = 1.6f;    // Step scale while the field allows it; 1 is plain sphere tracing
+    float hitEpsilon = 0.0002f;     // How close counts as on the surface
+
+    SdfObject(MaterialId mat)
+        : material(mat)
+    {
+    }
+
+    // Distance from a point to the surface; negative inside.  Must never over estimate
+    virtual float Distance(const vec3& pos) const = 0;
+
+    virtual MaterialId GetMaterialId(const HitRecord& hit, const vec3& pos) const override
+    {
+        return material;
+    }
+
+    virtual bool MayEmit(const MaterialTable& materials) const override
+    {
+        return materials[material].emissive != vec3(0.0f);
+    }
+
+    virtual SceneObjectType GetSceneObjectType() const override
+    {
+        return SceneObjectType::Sdf;
+    }
+
+    // Gradient of the field, from 4 samples on a tetrahedron
+    virtual vec3 GetSurfaceNormal(const HitRecord& hit, const vec3& pos) const override
+    {
+        const float h = 0.0005f;
+        const vec3 k0(1.0f, -1.0f, -1.0f);
+        const vec3 k1(-1.0f, -1.0f, 1.0f);
+        const vec3 k2(-1.0f, 1.0f, -1.0f);
+        const vec3 k3(1.0f, 1.0f, 1.0f);
+        return normalize(k0 * Distance(pos + k0 * h) +
+            k1 * Distance(pos + k1 * h) +
+            k2 * Distance(pos + k2 * h) +
+            k3 * Distance(pos + k3 * h));
+    }
+
+    virtual vec3 GetRayFrom(const vec3& from) const override
+    {
+        return normalize(bounds.Center() - from);
+    }
+
+    virtual bool MayBeWithin(const vec3& pos, float distance) const override
+    {
+        return bounds.DistanceTo(pos) <= distance;
+    }
+
+    virtual bool Intersects(const vec3& rayOrigin, const vec3& rayDir, HitRecord& hit) const override
+    {
+        float entry;
+        float exit;
+        if (!bounds.Clip(rayOrigin, 1.0f / rayDir, entry, exit))
+        {
+            return false;
+        }
+
+        float omega = overRelaxation;
+        float t = entry;
+        float stepLength = 0.0f;
+        float previousRadius = 0.0f;
+        for (int step = 0; step < maxSteps; step++)
+        {
+            float radius = Distance(rayOrigin + rayDir * t);
+
+            // The unbounding spheres of this step and the last don't overlap, so the relaxed step skipped
+            // past the surface; go back and carry on without relaxation
+            bool overstepped = omega > 1.0f && (std::abs(radius) + previousRadius) < stepLength;
+            if (overstepped)
+            {
+                t -= stepLength;
+                stepLength = 0.0f;
+                previousRadius = 0.0f;
+                omega = 1.0f;
+                continue;
+            }
+
+            if (radius < hitEpsilon)
+            {
+                hit.distance = t;
+                return true;
+            }
+
+            stepLength = radius * omega;
+            previousRadius = radius;
+            t += stepLength;
+            if (t > exit)
+            {
+                // A relaxed step may have jumped over a surface near the far side of the box; only an unrelaxed
+                // step leaving the box means a miss
+                if (omega > 1.0f)
+                {
+                    t -= stepLength;
+                    stepLength = 0.0f;
+                    previousRadius = 0.0f;
+                    omega = 1.0f;
+                    continue;
+                }
+                break;
+            }
+        }
+        return false;
+    }
+};
+
+// Polynomial smooth minimum, blending the two fields over a distance of k
+inline float SmoothMin(float a, float b, float k)
+{
+    float h = glm::clamp(0.5f + 0.5f * (b - a) / k, 0.0f, 1.0f);
+    return glm::mix(b, a, h) - k * h * (1.0f - h);
+}
+
+inline float SphereDistance(const vec3& pos, const vec3& center, float radius)
+{
+    return glm::length(pos - center) - radius;
+}
+
+inline float BoxDistance(const vec3& pos, const vec3& center, const vec3& halfSize)
+{
+    vec3 d = glm::abs(pos - center) - halfSize;
+    return glm::length(glm::max(d, vec3(0.0f))) + std::min(std::max(d.x, std::max(d.y, d.z)), 0.0f);
+}
+
+// A set of spheres melted together with a smooth union
+struct SdfBlob : SdfObject
+{
+    std::vector<vec4> spheres;      // xyz center, w radius
+    float blend;
+
+    SdfBlob(MaterialId mat, const std::vector<vec4>& s, float blendDistance)
+        : SdfObject(mat),
+        spheres(s),
+        blend(blendDistance)
+    {
+        // The smooth union never grows beyond the spheres by more than a quarter of the blend distance
+        for (auto& sphere : spheres)
+        {
+            bounds.Extend(vec3(sphere) - vec3(sphere.w + blend * 0.25f));
+            bounds.Extend(vec3(sphere) + vec3(sphere.w + blend * 0.25f));
+        }
+    }
+
+    virtual float Distance(const vec3& pos) const override
+    {
+        float d = std::numeric_limits<float>::max();
+        for (auto& sphere : spheres)
+        {
+            d = SmoothMin(d, SphereDistance(pos, vec3(sphere), sphere.w), blend);
+        }
+        return d;
+    }
+};
+
+// Constructive solid geometry: a box, intersected with a sphere, with a smaller sphere carved out of the middle
+struct SdfCsg : SdfObject
+{
+    vec3 center;
+    float size;
+
+    SdfCsg(MaterialId mat, const vec3& c, float halfSize)
+        : SdfObject(mat),
+        center(c),
+        size(halfSize)
+    {
+        bounds.Extend(center - vec3(size));
+        bounds.Extend(center + vec3(size));
+    }
+
+    virtual float Distance(const vec3& pos) const override
+    {
+        float box = BoxDistance(pos, center, vec3(size));
+        float outer = SphereDistance(pos, center, size * 1.35f);
+        float inner = SphereDistance(pos, center, size * 1.15f);
+        return std::max(std::max(box, outer), -inner);
+    }
+};
+
+// A Menger sponge; the field is exact, so detail comes at the cost of steps, not memory
+struct SdfMengerSponge : SdfObject
+{
+    vec3 center;
+    float size;
+    int iterations;
+
+    SdfMengerSponge(MaterialId mat, const vec3& c, float halfSize, int iterationCount)
+        : SdfObject(mat),
+        center(c),
+        size(halfSize),
+        iterations(iterationCount)
+    {
+        bounds.Extend(center - vec3(size));
+        bounds.Extend(center + vec3(size));
+    }
+
+    virtual float Distance(const vec3& pos) const override
+    {
+        vec3 p = (pos - center) / size;
+        float d = BoxDistance(p, vec3(0.0f), vec3(1.0f));
+
+        float scale = 1.0f;
+        for (int i = 0; i < iterations; i++)
+        {
+            // Fold space into one cell of the next level, and cut a cross through it
+            vec3 a = glm::mod(p * scale, 2.0f) - 1.0f;
+            scale *= 3.0f;
+            vec3 r = glm::abs(1.0f - 3.0f * glm::abs(a));
+
+            float da = std::max(r.x, r.y);
+            float db = std::max(r.y, r.z);
+            float dc = std::max(r.z, r.x);
+            float c = (std::min(da, std::min(db, dc)) - 1.0f) / scale;
+            d = std::max(d, c);
+        }
+        return d * size;
+    }
+};
@@ -0,0 +1,133 @@
+#pragma once
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Batched shading.
+// The diffuse + specular term for many (hit, emitter) pairs at once, from structure-of-arrays inputs.  With
+// AVX2, 8 pairs are shaded per instruction, with material colors gathered straight out of the material table;
+// otherwise, and for the last few pairs of a batch, each pair goes through the scalar PhongShading.
+
+// Hit/emitter pairs waiting to be shaded, and the light each one gets
+struct ShadingBatch
+{
+    std::vector<float> normalX, normalY, normalZ;
+    std::vector<float> reflectX, reflectY, reflectZ;
+    std::vector<float> lightX, lightY, lightZ;          // Direction to the emitter
+    std::vector<float> emissionR, emissionG, emissionB; // What the emitter gives out
+    std::vector<int32_t> material;
+
+    std::vector<float> colorR, colorG, colorB;          // Output
+
+    size_t Size() const
+    {
+        return material.size();
+    }
+
+    void Resize(size_t size)
+    {
+        for (auto pArray : { &normalX, &normalY, &normalZ, &reflectX, &reflectY, &reflectZ, &lightX, &lightY, &lightZ,
+            &emissionR, &emissionG, &emissionB, &colorR, &colorG, &colorB })
+        {
+            pArray->resize(size);
+        }
+        material.resize(size);
+    }
+
+    void Set(size_t i, MaterialId mat, const vec3& normal, const vec3& reflect, const vec3& light, const vec3& emission)
+    {
+        material[i] = mat;
+        normalX[i] = normal.x; normalY[i] = normal.y; normalZ[i] = normal.z;
+        reflectX[i] = reflect.x; reflectY[i] = reflect.y; reflectZ[i] = reflect.z;
+        lightX[i] = light.x; lightY[i] = light.y; lightZ[i] = light.z;
+        emissionR[i] = emission.r; emissionG[i] = emission.g; emissionB[i] = emission.b;
+    }
+
+    vec3 Color(size_t i) const
+    {
+        return vec3(colorR[i], colorG[i], colorB[i]);
+    }
+};
+
+#if defined(__AVX2__)
+// x ^ N on 8 lanes, expanded at compile time by repeated squaring
+template<int N>
+inline __m256 PowerOf(__m256 x)
+{
+    __m256 rest = PowerOf<N / 2>(_mm256_mul_ps(x, x));
+    return N & 1 ? _mm256_mul_ps(x, rest) : rest;
+}
+
+template<>
+inline __m256 PowerOf<0>(__m256 x)
+{
+    return _mm256_set1_ps(1.0f);
+}
+#endif
+
+// Shade pairs [begin, end) of the batch with PhongShading<SpecularPower>.  Separate ranges can be shaded on
+// separate threads
+template<int SpecularPower>
+void ShadeBatch(ShadingBatch& batch, const MaterialTable& materials, size_t begin, size_t end)
+{
+    size_t i = begin;
+
+#if defined(__AVX2__)
+    // Material colors are gathered from the table in place, a field at a time
+    static_assert(sizeof(Material) % sizeof(float) == 0, "Material must be a whole number of floats");
+    const __m256i stride = _mm256_set1_epi32(int(sizeof(Material) / sizeof(float)));
+    const Material* pTable = materials.materials.data();
+    const __m256 zero = _mm256_setzero_ps();
+
+    for (; i + 8 <= end; i += 8)
+    {
+        __m256 nx = _mm256_loadu_ps(&batch.normalX[i]);
+        __m256 ny = _mm256_loadu_ps(&batch.normalY[i]);
+        __m256 nz = _mm256_loadu_ps(&batch.normalZ[i]);
+        __m256 lx = _mm256_loadu_ps(&batch.lightX[i]);
+        __m256 ly = _mm256_loadu_ps(&batch.lightY[i]);
+        __m256 lz = _mm256_loadu_ps(&batch.lightZ[i]);
+
+        __m256 diffuseI = _mm256_fmadd_ps(nx, lx, _mm256_fmadd_ps(ny, ly, _mm256_mul_ps(nz, lz)));
+        __m256 lit = _mm256_cmp_ps(diffuseI, zero, _CMP_GT_OQ);
+        diffuseI = _mm256_and_ps(diffuseI, lit);
+
+        // Only lit points get a highlight
+        __m256 specI = _mm256_fmadd_ps(_mm256_loadu_ps(&batch.reflectX[i]), lx,
+            _mm256_fmadd_ps(_mm256_loadu_ps(&batch.reflectY[i]), ly,
+                _mm256_mul_ps(_mm256_loadu_ps(&batch.reflectZ[i]), lz)));
+        specI = _mm256_and_ps(_mm256_and_ps(PowerOf<SpecularPower>(specI), _mm256_cmp_ps(specI, zero, _CMP_GT_OQ)), lit);
+
+        __m256i index = _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*)&batch.material[i]), stride);
+        auto shade = [&](const float* pAlbedo, const float* pSpecular, const float* pEmission, float* pOut)
+        {
+            __m256 albedo = _mm256_i32gather_ps(pAlbedo, index, 4);
+            __m256 specular = _mm256_i32gather_ps(pSpecular, index, 4);
+            __m256 emission = _mm256_loadu_ps(pEmission);
+            _mm256_storeu_ps(pOut, _mm256_fmadd_ps(_mm256_mul_ps(emission, albedo), diffuseI, _mm256_mul_ps(specular, specI)));
+        };
+        shade(&pTable->albedo.x, &pTable->specular.x, &batch.emissionR[i], &batch.colorR[i]);
+        shade(&pTable->albedo.y, &pTable->specular.y, &batch.emissionG[i], &batch.colorG[i]);
+        shade(&pTable->albedo.z, &pTable->specular.z, &batch.emissionB[i], &batch.colorB[i]);
+    }
+#endif
+
+    for (; i < end; i++)
+    {
+        vec3 color = PhongShading<SpecularPower>::Shade(materials[MaterialId(batch.material[i])],
+            vec3(batch.normalX[i], batch.normalY[i], batch.normalZ[i]),
+            vec3(batch.reflectX[i], batch.reflectY[i], batch.reflectZ[i]),
+            vec3(batch.lightX[i], batch.lightY[i], batch.lightZ[i]),
+            vec3(batch.emissionR[i], batch.emissionG[i], batch.emissionB[i]));
+        batch.colorR[i] = color.r;
+        batch.colorG[i] = color.g;
+        batch.colorB[i] = color.b;
+    }
+}
+
+template<int SpecularPower>
+void ShadeBatch(ShadingBatch& batch, const MaterialTable& materials)
+{
+    ShadeBatch<SpecularPower>(batch, materials, 0, batch.Size());
+}
@@ -0,0 +1,454 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+// Displaced subdivision surfaces, tessellated lazily.
+// The control cage is a regular grid of heights over the xz plane.  Every 4x4 window of the cage is a uniform
+// bicubic B-spline patch, which is exactly the Catmull-Clark limit surface for a regular quad mesh.
+// A patch is only diced into micro triangles when a ray first reaches its bounding box, and the diced mesh is kept
+// in a fixed size cache shared by all the render threads, so geometry that no ray sees is never built.
+
+// A diced patch: a grid of displaced vertices, with bounds for each block of quads so rays can skip most of them
+struct MicroMesh
+{
+    static const int BlockSize = 8;     // Quads along the side of a block
+
+    int resolution = 0;                 // Quads along the side of the patch
+    std::vector<vec3> positions;        // (resolution + 1) ^ 2 vertices
+    std::vector<vec3> normals;
+    std::vector<BoundingBox> blocks;    // (resolution / BlockSize) ^ 2 block bounds
+
+    const vec3& Position(int x, int z) const
+    {
+        return positions[z * (resolution + 1) + x];
+    }
+
+    const vec3& Normal(int x, int z) const
+    {
+        return normals[z * (resolution + 1) + x];
+    }
+
+    // Find the nearest micro triangle hit closer than the one already in 'hit'.  Triangles are numbered from
+    // firstTriangle, two per quad, in row order.  Blocks are tested front to back, so those behind a hit are
+    // never opened
+    bool Intersects(const vec3& rayOrigin, const vec3& rayDir, const vec3& invRayDir, uint32_t firstTriangle, HitRecord& hit) const
+    {
+        thread_local std::vector<std::pair<float, int>> candidates;
+        candidates.clear();
+        for (int b = 0; b < int(blocks.size()); b++)
+        {
+            float entry;
+            if (blocks[b].Intersects(rayOrigin, invRayDir, hit.distance, entry))
+            {
+                candidates.push_back(std::make_pair(entry, b));
+            }
+        }
+        std::sort(candidates.begin(), candidates.end());
+
+        bool found = false;
+        const int blocksPerSide = resolution / BlockSize;
+        for (auto& candidate : candidates)
+        {
+            if (candidate.first > hit.distance)
+            {
+                break;
+            }
+
+            int startX = (candidate.second % blocksPerSide) * BlockSize;
+            int startZ = (candidate.second / blocksPerSide) * BlockSize;
+            for (int z = startZ; z < startZ + BlockSize; z++)
+            {
+                for (int x = startX; x < startX + BlockSize; x++)
+                {
+                    // Two triangles per quad
+                    vec3 corners[3];
+                    for (int half = 0; half < 2; half++)
+                    {
+                        GetTriangle(x, z, half, corners);
+
+                        vec3 bary;
+                        if (glm::intersectRayTriangle(rayOrigin, rayDir, corners[0], corners[1], corners[2], bary) && bary.z < hit.distance)
+                        {
+                            hit.distance = bary.z;
+                            hit.subPrimitive = firstTriangle + uint32_t(((z * resolution) + x) * 2 + half);
+                            hit.uv = vec2(bary.x, bary.y);
+                            found = true;
+                        }
+                    }
+                }
+            }
+        }
+        return found;
+    }
+
+    // The corners of one half of a quad
+    void GetTriangle(int x, int z, int half, vec3* corners) const
+    {
+        corners[0] = Position(x, z);
+        corners[1] = half == 0 ? Position(x + 1, z) : Position(x + 1, z + 1);
+        corners[2] = half == 0 ? Position(x + 1, z + 1) : Position(x, z + 1);
+    }
+
+    // Smooth normal at a point on a micro triangle
+    vec3 GetNormal(int triangle, const vec2& bary) const
+    {
+        int quad = triangle / 2;
+        int x = quad % resolution;
+        int z = quad / resolution;
+        const vec3& n0 = Normal(x, z);
+        const vec3& n1 = (triangle & 1) == 0 ? Normal(x + 1, z) : Normal(x + 1, z + 1);
+        const vec3& n2 = (triangle & 1) == 0 ? Normal(x + 1, z + 1) : Normal(x, z + 1);
+        return normalize(n0 * (1.0f - bary.x - bary.y) + n1 * bary.x + n2 * bary.y);
+    }
+};
+
+// A fixed number of diced patches, shared between threads.
+// Meshes are handed out as shared pointers, so a patch evicted by one thread stays alive for any thread still
+// tracing against it.  Dicing happens outside the lock; if two threads race to dice the same patch, the first
+// one into the cache wins and the other result is dropped.
+// Each thread also keeps a few of the meshes it used last, so most lookups touch neither the lock nor a
+// reference count; the shared map is only consulted when a ray reaches a patch the thread hasn't seen lately.
+// Those can outlive their eviction, so memory is bounded by the capacity plus a few meshes per thread.
+class TessellationCache
+{
+public:
+    // Meshes each thread holds on to, on top of the shared ones
+    static const int ThreadSlotBits = 4;
+    static const int ThreadSlots = 1 << ThreadSlotBits;
+
+    explicit TessellationCache(size_t maxEntries)
+        : capacity(std::max(size_t(1), maxEntries)),
+        id(NextId()++)
+    {
+    }
+
+    // The mesh for a patch, diced the first time it is asked for.  The reference stays good until the same
+    // thread's next call
+    template<typename DiceFunction>
+    const MicroMesh& Acquire(uint32_t key, DiceFunction dice)
+    {
+        // Hashed, so patches next to each other in either direction land in different slots
+        auto& slot = LocalSlots()[(key * 0x9e3779b1u) >> (32 - ThreadSlotBits)];
+        if (slot.cacheId != id || slot.key != key || !slot.spMesh)
+        {
+            slot.spMesh = AcquireShared(key, dice);
+            slot.cacheId = id;
+            slot.key = key;
+        }
+        return *slot.spMesh;
+    }
+
+    void PrintStats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::cout << "Tessellation cache: " << hits << " shared hits, " << misses << " patches diced, " << evictions << " evicted" << std::endl;
+    }
+
+private:
+    struct Entry
+    {
+        std::shared_ptr<const MicroMesh> spMesh;
+        uint64_t lastUse;
+    };
+
+    struct ThreadSlot
+    {
+        uint64_t cacheId = 0;
+        uint32_t key = 0;
+        std::shared_ptr<const MicroMesh> spMesh;
+    };
+
+    // Caches are told apart by a serial number rather than their address, which a later cache could reuse
+    static std::atomic<uint64_t>& NextId()
+    {
+        static std::atomic<uint64_t> nextId{ 1 };
+        return nextId;
+    }
+
+    static ThreadSlot* LocalSlots()
+    {
+        thread_local ThreadSlot slots[ThreadSlots];
+        return slots;
+    }
+
+    template<typename DiceFunction>
+    std::shared_ptr<const MicroMesh> AcquireShared(uint32_t key, DiceFunction dice)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto itr = entries.find(key);
+            if (itr != entries.end())
+            {
+                itr->second.lastUse = ++useCounter;
+                hits++;
+                return itr->second.spMesh;
+            }
+        }
+
+        auto spMesh = std::make_shared<const MicroMesh>(dice());
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto itr = entries.find(key);
+        if (itr != entries.end())
+        {
+            itr->second.lastUse = ++useCounter;
+            return itr->second.spMesh;
+        }
+
+        // Full; throw out the least recently used patch
+        if (entries.size() >= capacity)
+        {
+            auto victim = entries.begin();
+            for (auto candidate = entries.begin(); candidate != entries.end(); ++candidate)
+            {
+                if (candidate->second.lastUse < victim->second.lastUse)
+                {
+                    victim = candidate;
+                }
+            }
+            entries.erase(victim);
+            evictions++;
+        }
+
+        entries[key] = Entry{ spMesh, ++useCounter };
+        misses++;
+        return spMesh;
+    }
+
+    mutable std::mutex mutex;
+    std::unordered_map<uint32_t, Entry> entries;
+    size_t capacity;
+    uint64_t id;
+    uint64_t useCounter = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+};
+
+// A height field cage of B-spline patches, displaced upwards by a procedural detail function
+struct DisplacedSurface : SceneObject
+{
+    MaterialId material;
+
+    std::shared_ptr<TessellationCache> spCache;
+    uint32_t cacheKeyBase;      // Distinguishes this surface's patches from others sharing the cache
+
+    vec3 origin;                // World position of control point (0, 0)
+    float spacing;              // Distance between control points in x and z
+    int pointsX;                // Control points along x and z
+    int pointsZ;
+    std::vector<float> heights; // pointsX * pointsZ control point heights
+
+    float amplitude;            // Largest displacement, in world units
+    int dicingRate;             // Quads along the side of a diced patch; a multiple of MicroMesh::BlockSize
+
+    std::vector<BoundingBox> patchBounds;   // Conservative bounds of each displaced patch, before dicing
+    BoundingBox bounds;
+
+    DisplacedSurface(MaterialId mat, std::shared_ptr<TessellationCache> cache, uint32_t keyBase, const vec3& o, float space, int countX, int countZ, const std::vector<float>& controlHeights, float displacementAmplitude, int rate)
+        : material(mat),
+        spCache(cache),
+        cacheKeyBase(keyBase),
+        origin(o),
+        spacing(space),
+        pointsX(countX),
+        pointsZ(countZ),
+        heights(controlHeights),
+        amplitude(displacementAmplitude),
+        dicingRate(std::max(rate / MicroMesh::BlockSize, 1) * MicroMesh::BlockSize)
+    {
+        // A B-spline patch lies within the convex hull of its control points, so the control heights plus the
+        // displacement range bound it without evaluating anything
+        for (int pz = 0; pz < PatchesZ(); pz++)
+        {
+            for (int px = 0; px < PatchesX(); px++)
+            {
+                float minHeight = std::numeric_limits<float>::max();
+                float maxHeight = -std::numeric_limits<float>::max();
+                for (int j = 0; j < 4; j++)
+                {
+                    for (int i = 0; i < 4; i++)
+                    {
+                        minHeight = std::min(minHeight, Height(px + i, pz + j));
+                        maxHeight = std::max(maxHeight, Height(px + i, pz + j));
+                    }
+                }
+
+                BoundingBox box;
+                box.Extend(origin + vec3((px + 1) * spacing, minHeight - amplitude, (pz + 1) * spacing));
+                box.Extend(origin + vec3((px + 2) * spacing, maxHeight + amplitude, (pz + 2) * spacing));
+                patchBounds.push_back(box);
+                bounds.Extend(box);
+            }
+        }
+    }
+
+    int PatchesX() const { return pointsX - 3; }
+    int PatchesZ() const { return pointsZ - 3; }
+
+    float Height(int x, int z) const
+    {
+        return heights[z * pointsX + x];
+    }
+
+    // Procedural surface detail; stays within +/- amplitude
+    float Displacement(float x, float z) const
+    {
+        float d = 0.5f * sin(x * 3.1f) * sin(z * 2.7f);
+        d += 0.3f * sin((x + z) * 7.3f);
+        d += 0.2f * sin(x * 17.0f) * sin(z * 19.0f);
+        return d * amplitude;
+    }
+
+    // Dice a patch into a displaced grid of micro triangles
+    MicroMesh Dice(int patch) const
+    {
+        int px = patch % PatchesX();
+        int pz = patch / PatchesX();
+
+        MicroMesh mesh;
+        mesh.resolution = dicingRate;
+        const int vertsPerSide = dicingRate + 1;
+        mesh.positions.resize(vertsPerSide * vertsPerSide);
+        mesh.normals.resize(vertsPerSide * vertsPerSide);
+
+        for (int z = 0; z < vertsPerSide; z++)
+        {
+            float bz[4];
+            BSplineBasis(float(z) / dicingRate, bz);
+            for (int x = 0; x < vertsPerSide; x++)
+            {
+                float bx[4];
+                BSplineBasis(float(x) / dicingRate, bx);
+
+                float height = 0.0f;
+                for (int j = 0; j < 4; j++)
+                {
+                    for (int i = 0; i < 4; i++)
+                    {
+                        height += bx[i] * bz[j] * Height(px + i, pz + j);
+                    }
+                }
+
+                // The B-spline reproduces the evenly spaced x/z of the cage, so the limit point is directly above
+                // its parametric position
+                vec3 pos = origin + vec3((px + 1 + float(x) / dicingRate) * spacing, 0.0f, (pz + 1 + float(z) / dicingRate) * spacing);
+                pos.y = height + Displacement(pos.x, pos.z);
+                mesh.positions[z * vertsPerSide + x] = pos;
+            }
+        }
+
+        // Smooth vertex normals from the diced grid, one sided at the patch edges
+        for (int z = 0; z < vertsPerSide; z++)
+        {
+            for (int x = 0; x < vertsPerSide; x++)
+            {
+                vec3 dx = mesh.Position(std::min(x + 1, dicingRate), z) - mesh.Position(std::max(x - 1, 0), z);
+                vec3 dz = mesh.Position(x, std::min(z + 1, dicingRate)) - mesh.Position(x, std::max(z - 1, 0));
+                mesh.normals[z * vertsPerSide + x] = normalize(cross(dz, dx));
+            }
+        }
+
+        const int blocksPerSide = dicingRate / MicroMesh::BlockSize;
+        mesh.blocks.resize(blocksPerSide * blocksPerSide);
+        for (int b = 0; b < int(mesh.blocks.size()); b++)
+        {
+            int startX = (b % blocksPerSide) * MicroMesh::BlockSize;
+            int startZ = (b / blocksPerSide) * MicroMesh::BlockSize;
+            for (int z = startZ; z <= startZ + MicroMesh::BlockSize; z++)
+            {
+                for (int x = startX; x <= startX + MicroMesh::BlockSize; x++)
+                {
+                    mesh.blocks[b].Extend(mesh.Position(x, z));
+                }
+            }
+        }
+        return mesh;
+    }
+
+    const MicroMesh& GetMesh(int patch) const
+    {
+        return spCache->Acquire(cacheKeyBase + uint32_t(patch), [&]() { return Dice(patch); });
+    }
+
+    virtual MaterialId GetMaterialId(const HitRecord& hit, const vec3& pos) const override
+    {
+        return material;
+    }
+
+    virtual bool MayEmit(const MaterialTable& materials) const override
+    {
+        return materials[material].emissive != vec3(0.0f);
+    }
+
+    virtual SceneObjectType GetSceneObjectType() const override
+    {
+        return SceneObjectType::Surface;
+    }
+
+    virtual vec3 GetSurfaceNormal(const HitRecord& hit, const vec3& pos) const override
+    {
+        // The hit record tells us which micro triangle we hit, and where on it
+        const uint32_t trianglesPerPatch = uint32_t(dicingRate * dicingRate * 2);
+        return GetMesh(int(hit.subPrimitive / trianglesPerPatch)).GetNormal(int(hit.subPrimitive % trianglesPerPatch), hit.uv);
+    }
+
+    virtual vec3 GetRayFrom(const vec3& from) const override
+    {
+        return normalize(bounds.Center() - from);
+    }
+
+    virtual bool MayBeWithin(const vec3& pos, float distance) const override
+    {
+        return bounds.DistanceTo(pos) <= distance;
+    }
+
+    virtual bool Intersects(const vec3& rayOrigin, const vec3& rayDir, HitRecord& hit) const override
+    {
+        vec3 invRayDir = 1.0f / rayDir;
+        float entry;
+        hit.distance = std::numeric_limits<float>::max();
+        if (!bounds.Intersects(rayOrigin, invRayDir, hit.distance, entry))
+        {
+            return false;
+        }
+
+        // Visit the patches the ray reaches front to back, so the ones behind the first hit are never diced.
+        // The list is kept per thread, so rays don't allocate
+        thread_local std::vector<std::pair<float, int>> candidates;
+        candidates.clear();
+        for (int patch = 0; patch < int(patchBounds.size()); patch++)
+        {
+            if (patchBounds[patch].Intersects(rayOrigin, invRayDir, hit.distance, entry))
+            {
+                candidates.push_back(std::make_pair(entry, patch));
+            }
+        }
+        std::sort(candidates.begin(), candidates.end());
+
+        const uint32_t trianglesPerPatch = uint32_t(dicingRate * dicingRate * 2);
+        bool found = false;
+        for (auto& candidate : candidates)
+        {
+            if (candidate.first > hit.distance)
+            {
+                break;
+            }
+            found |= GetMesh(candidate.second).Intersects(rayOrigin, rayDir, invRayDir, candidate.second * trianglesPerPatch, hit);
+        }
+        return found;
+    }
+
+private:
+    // Uniform cubic B-spline weights
+    static void BSplineBasis(float t, float* weights)
+    {
+        float it = 1.0f - t;
+        weights[0] = (it * it * it) / 6.0f;
+        weights[1] = (3.0f * t * t * t - 6.0f * t * t + 4.0f) / 6.0f;
+        weights[2] = (-3.0f * t * t * t + 3.0f * t * t + 3.0f * t + 1.0f) / 6.0f;
+        weights[3] = (t * t * t) / 6.0f;
+    }
+};
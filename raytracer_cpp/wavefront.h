@@ -0,0 +1,595 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// A wavefront (stream) renderer.
+// Instead of following one path at a time depth first, as TraceRay does, every path in a batch moves forward
+// together, one stage at a time: generate camera rays, extend them to their closest hits, shade the hits,
+// test the shadow rays shading asked for, and accumulate what got through.  Each stage is a tight parallel loop
+// over a structure-of-arrays queue, so only one kernel's code and data are hot at once, however incoherent the
+// rays themselves are.
+// The stages run on a pool of threads started once per render; a stage only wakes them and waits.
+
+// Threads kept for the whole render, so the thousands of stage loops in a frame don't each start and join their own
+class WorkerPool
+{
+public:
+    explicit WorkerPool(int threads)
+        : size(std::max(1, threads))
+    {
+        // The calling thread takes the first chunk itself
+        for (int worker = 1; worker < size; worker++)
+        {
+            workers.emplace_back([this, worker]() { Work(worker); });
+        }
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : workers)
+        {
+            t.join();
+        }
+    }
+
+    // How many chunks a loop is split into
+    int Size() const
+    {
+        return size;
+    }
+
+    // Run f(chunk, begin, end) over [0, count) split into one contiguous chunk per thread, and wait for them all.
+    // Chunks are in order, so chunk c covers indices before chunk c + 1
+    template<typename F>
+    void ForChunks(size_t count, const F& f)
+    {
+        const size_t chunk = (count + size - 1) / size;
+        std::function<void(int)> run = [&](int c)
+        {
+            size_t begin = std::min(count, size_t(c) * chunk);
+            size_t end = std::min(count, begin + chunk);
+            if (begin < end)
+            {
+                f(c, begin, end);
+            }
+        };
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pJob = &run;
+            pending = int(workers.size());
+            generation++;
+        }
+        wake.notify_all();
+        run(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&]() { return pending == 0; });
+        pJob = nullptr;
+    }
+
+    // Run f(begin, end) over [0, count) split into one contiguous chunk per thread
+    template<typename F>
+    void For(size_t count, const F& f)
+    {
+        ForChunks(count, [&](int, size_t begin, size_t end) { f(begin, end); });
+    }
+
+private:
+    void Work(int chunk)
+    {
+        uint64_t seen = 0;
+        for (;;)
+        {
+            const std::function<void(int)>* pRun;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&]() { return stopping || generation != seen; });
+                if (stopping)
+                {
+                    return;
+                }
+                seen = generation;
+                pRun = pJob;
+            }
+
+            (*pRun)(chunk);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0)
+            {
+                done.notify_one();
+            }
+        }
+    }
+
+    int size;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(int)>* pJob = nullptr;
+    uint64_t generation = 0;
+    int pending = 0;
+    bool stopping = false;
+};
+
+// Spread the low 10 bits of x out to every third bit
+inline uint32_t Part1By2(uint32_t x)
+{
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+// A sort key that puts rays going the same way from nearby places next to each other: the direction octant
+// on top, then the Morton code of the origin within the given bounds
+inline uint32_t CoherenceKey(const vec3& origin, const vec3& dir, const BoundingBox& bounds)
+{
+    uint32_t octant = (dir.x < 0.0f ? 1 : 0) | (dir.y < 0.0f ? 2 : 0) | (dir.z < 0.0f ? 4 : 0);
+    vec3 cell = glm::clamp((origin - bounds.min) / glm::max(bounds.max - bounds.min, vec3(1e-6f)), vec3(0.0f), vec3(1.0f)) * 1023.0f;
+    return (octant << 29) | (Part1By2(uint32_t(cell.x)) << 2) | (Part1By2(uint32_t(cell.y)) << 1) | Part1By2(uint32_t(cell.z));
+}
+
+// Rays in flight, one per path
+struct RayQueue
+{
+    std::vector<float> originX, originY, originZ;
+    std::vector<float> dirX, dirY, dirZ;
+    std::vector<float> throughputR, throughputG, throughputB;
+    std::vector<uint32_t> path;     // Which path in the batch the ray belongs to
+
+    size_t Size() const
+    {
+        return path.size();
+    }
+
+    void Resize(size_t size)
+    {
+        for (auto pArray : { &originX, &originY, &originZ, &dirX, &dirY, &dirZ, &throughputR, &throughputG, &throughputB })
+        {
+            pArray->resize(size);
+        }
+        path.resize(size);
+    }
+
+    void Set(size_t i, uint32_t pathIndex, const vec3& origin, const vec3& dir, const vec3& throughput)
+    {
+        path[i] = pathIndex;
+        originX[i] = origin.x; originY[i] = origin.y; originZ[i] = origin.z;
+        dirX[i] = dir.x; dirY[i] = dir.y; dirZ[i] = dir.z;
+        throughputR[i] = throughput.r; throughputG[i] = throughput.g; throughputB[i] = throughput.b;
+    }
+
+    vec3 Origin(size_t i) const { return vec3(originX[i], originY[i], originZ[i]); }
+    vec3 Direction(size_t i) const { return vec3(dirX[i], dirY[i], dirZ[i]); }
+    vec3 Throughput(size_t i) const { return vec3(throughputR[i], throughputG[i], throughputB[i]); }
+};
+
+// Shadow rays asked for by shading, in fixed slots per (ray, emitter) so no stage has to synchronize.  Only
+// objects that can emit get a slot.  The shadow stage works through the active slots in 'order'
+struct ShadowQueue
+{
+    std::vector<float> originX, originY, originZ;
+    std::vector<float> dirX, dirY, dirZ;
+    std::vector<float> maxDistance;
+    std::vector<uint32_t> emitterId;    // The object we are looking for; it can't occlude itself
+    std::vector<vec3> contribution;     // What the light adds to the path if nothing is in the way
+    std::vector<uint8_t> active;        // Slot holds a shadow ray
+    std::vector<uint8_t> visible;       // Result of the any-hit test
+    std::vector<uint32_t> order;        // Active slots, in the order to trace them
+
+    void Resize(size_t size)
+    {
+        for (auto pArray : { &originX, &originY, &originZ, &dirX, &dirY, &dirZ, &maxDistance })
+        {
+            pArray->resize(size);
+        }
+        emitterId.resize(size);
+        contribution.resize(size);
+        active.assign(size, 0);
+        visible.resize(size);
+    }
+
+    vec3 Origin(size_t i) const { return vec3(originX[i], originY[i], originZ[i]); }
+    vec3 Direction(size_t i) const { return vec3(dirX[i], dirY[i], dirZ[i]); }
+};
+
+class WavefrontRenderer
+{
+public:
+    WavefrontRenderer(const std::vector<std::shared_ptr<SceneObject>>& objects, const MaterialTable& mats, const PathSettings& settings, const vec3& background, int depth, int threads, bool sort)
+        : sceneObjects(objects),
+        materials(mats),
+        pathSettings(settings),
+        backgroundColor(background),
+        maxDepth(depth),
+        pool(threads),
+        sortRays(sort)
+    {
+        // Everything else can't light a hit, so never needs a shadow ray
+        for (uint32_t id = 0; id < uint32_t(sceneObjects.size()); id++)
+        {
+            if (sceneObjects[id]->MayEmit(materials))
+            {
+                emitters.push_back(id);
+            }
+        }
+    }
+
+    // Render width x height pixels, with one path for each sample offset in the pattern, averaged
+    void Render(Camera& camera, int width, int height, const std::vector<vec2>& pattern, std::vector<vec3>& image)
+    {
+        image.assign(size_t(width) * height, vec3(0.0f));
+
+        const size_t pathCount = size_t(width) * height * pattern.size();
+        const float sampleWeight = 1.0f / float(pattern.size());
+        const size_t emitterCount = emitters.size();
+
+        for (size_t batchStart = 0; batchStart < pathCount; batchStart += BatchSize)
+        {
+            const size_t batchSize = std::min(BatchSize, pathCount - batchStart);
+            radiance.assign(batchSize, vec3(0.0f));
+
+            // Generate: camera rays, pixel by pixel with all samples of a pixel together
+            rays.Resize(batchSize);
+            pool.For(batchSize, [&](size_t begin, size_t end)
+            {
+                for (size_t i = begin; i < end; i++)
+                {
+                    size_t pathIndex = batchStart + i;
+                    size_t pixel = pathIndex / pattern.size();
+                    const vec2& offset = pattern[pathIndex % pattern.size()];
+                    vec2 sample(float(pixel % width) + offset.x, float(pixel / width) + offset.y);
+                    rays.Set(i, uint32_t(i), camera.position, camera.GetWorldRay(sample), vec3(1.0f));
+                }
+            });
+
+            for (int depth = 0; depth <= maxDepth && rays.Size() > 0; depth++)
+            {
+                Extend();
+                Shade(depth, emitterCount);
+                QueueShadows(emitterCount);
+                Shadow();
+                Accumulate(emitterCount);
+                Compact();
+            }
+
+            // Paths for the same pixel are adjacent, so this is cheap to do in order
+            for (size_t i = 0; i < batchSize; i++)
+            {
+                image[(batchStart + i) / pattern.size()] += radiance[i] * sampleWeight;
+            }
+        }
+    }
+
+private:
+    // Extend: closest hit for every ray in the queue
+    void Extend()
+    {
+        hits.resize(rays.Size());
+        pool.For(rays.Size(), [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+            {
+                vec3 origin = rays.Origin(i);
+                vec3 dir = rays.Direction(i);
+                HitRecord& nearest = hits[i];
+                nearest = HitRecord();
+                for (uint32_t id = 0; id < uint32_t(sceneObjects.size()); id++)
+                {
+                    HitRecord hit;
+                    if (sceneObjects[id]->Intersects(origin, dir, hit) &&
+                        nearest.distance > hit.distance)
+                    {
+                        nearest = hit;
+                        nearest.primitiveId = id;
+                    }
+                }
+            }
+        });
+    }
+
+    // Shade: add emission, find the emitters each hit can see, and where the path goes next
+    void Shade(int depth, size_t emitterCount)
+    {
+        shadows.Resize(rays.Size() * emitterCount);
+        nextRays.resize(rays.Size(), PathState(vec3(0.0f), vec3(0.0f)));
+        continues.assign(rays.Size(), 0);
+
+        pool.For(rays.Size(), [&](size_t begin, size_t end)
+        {
+            // Hit/emitter pairs are shaded in blocks small enough to stay in cache; each slot holds the weight of
+            // its light until the block is shaded.  Pairs that get no light aren't worth a shadow ray
+            const size_t ShadingBlockSize = 256;
+            ShadingBatch lights;
+            lights.Resize(ShadingBlockSize);
+            std::vector<uint32_t> lightSlots(ShadingBlockSize);
+            size_t queuedLights = 0;
+            auto shadeLights = [&]()
+            {
+                ShadeBatch<10>(lights, materials, 0, queuedLights);
+                for (size_t j = 0; j < queuedLights; j++)
+                {
+                    vec3 light = lights.Color(j);
+                    shadows.contribution[lightSlots[j]] *= light;
+                    shadows.active[lightSlots[j]] = light != vec3(0.0f);
+                }
+                queuedLights = 0;
+            };
+
+            for (size_t i = begin; i < end; i++)
+            {
+                const HitRecord& hit = hits[i];
+                vec3 throughput = rays.Throughput(i);
+                vec3& pathRadiance = radiance[rays.path[i]];
+                if (hit.primitiveId == NoPrimitive)
+                {
+                    pathRadiance += throughput * backgroundColor;
+                    continue;
+                }
+
+                ShadingPoint surface(sceneObjects[hit.primitiveId].get(), hit, rays.Origin(i), rays.Direction(i));
+                const vec3& pos = surface.GetPosition();
+                const vec3& normal = surface.GetNormal();
+                const Material& material = materials[surface.GetMaterialId()];
+                vec3 reflect = glm::normalize(glm::reflect(rays.Direction(i), normal));
+
+                pathRadiance += throughput * material.emissive;
+
+                vec3 lightWeight = throughput * (1.f - material.reflectance);
+                for (uint32_t emitter = 0; emitter < uint32_t(emitterCount); emitter++)
+                {
+                    uint32_t emitterId = emitters[emitter];
+                    const SceneObject* pEmitter = sceneObjects[emitterId].get();
+                    vec3 emitterDir = pEmitter->GetRayFrom(pos);
+                    vec3 shadowOrigin = pos + (emitterDir * 0.001f);
+
+                    HitRecord emitterHit;
+                    if (!pEmitter->Intersects(shadowOrigin, emitterDir, emitterHit))
+                    {
+                        continue;
+                    }
+
+                    const Material& emitterMat = materials[pEmitter->GetMaterialId(emitterHit, pos + (emitterDir * emitterHit.distance))];
+                    if (emitterMat.emissive == vec3(0.0f, 0.0f, 0.0f))
+                    {
+                        continue;
+                    }
+
+                    size_t slot = i * emitterCount + emitter;
+                    shadows.originX[slot] = shadowOrigin.x;
+                    shadows.originY[slot] = shadowOrigin.y;
+                    shadows.originZ[slot] = shadowOrigin.z;
+                    shadows.dirX[slot] = emitterDir.x;
+                    shadows.dirY[slot] = emitterDir.y;
+                    shadows.dirZ[slot] = emitterDir.z;
+                    shadows.maxDistance[slot] = emitterHit.distance;
+                    shadows.emitterId[slot] = emitterId;
+                    shadows.contribution[slot] = lightWeight;
+
+                    if (queuedLights == ShadingBlockSize)
+                    {
+                        shadeLights();
+                    }
+                    lightSlots[queuedLights] = uint32_t(slot);
+                    lights.Set(queuedLights++, surface.GetMaterialId(), normal, reflect, emitterDir, emitterMat.emissive);
+                }
+
+                // Follow the reflection, if it can still be seen
+                PathState path(rays.Origin(i), rays.Direction(i));
+                path.throughput = throughput;
+                path.depth = depth;
+                if (path.depth < maxDepth &&
+                    material.reflectance > 0.0f &&
+                    path.Extend(pos + (reflect * 0.001f), reflect, material.reflectance * (1.f - material.reflectance), pathSettings))
+                {
+                    nextRays[i] = path;
+                    continues[i] = 1;
+                }
+            }
+            shadeLights();
+        });
+    }
+
+    // Collect the shadow rays to trace.  Each chunk of rays counts its active slots, a prefix sum over the counts
+    // gives each chunk where its slots go, and the chunks write them there in parallel.  When sorting, rays are
+    // already in origin order, so taking the slots emitter by emitter buckets them by direction as well, without
+    // paying for another sort; the chunks then count a run per emitter
+    void QueueShadows(size_t emitterCount)
+    {
+        const size_t chunks = size_t(pool.Size());
+        const size_t runsPerChunk = sortRays ? emitterCount : 1;
+        runCounts.assign(chunks * runsPerChunk, 0);
+        pool.ForChunks(rays.Size(), [&](int chunk, size_t begin, size_t end)
+        {
+            uint32_t* pCounts = &runCounts[size_t(chunk) * runsPerChunk];
+            for (size_t i = begin; i < end; i++)
+            {
+                for (size_t emitter = 0; emitter < emitterCount; emitter++)
+                {
+                    if (shadows.active[i * emitterCount + emitter])
+                    {
+                        pCounts[sortRays ? emitter : 0]++;
+                    }
+                }
+            }
+        });
+
+        // Runs are laid out emitter by emitter, and chunk by chunk within that, so the order is the same as
+        // scanning the slots serially
+        uint32_t total = PrefixSum(chunks, runsPerChunk);
+        shadows.order.resize(total);
+
+        pool.ForChunks(rays.Size(), [&](int chunk, size_t begin, size_t end)
+        {
+            uint32_t* pNext = &runStarts[size_t(chunk) * runsPerChunk];
+            for (size_t i = begin; i < end; i++)
+            {
+                for (size_t emitter = 0; emitter < emitterCount; emitter++)
+                {
+                    size_t slot = i * emitterCount + emitter;
+                    if (shadows.active[slot])
+                    {
+                        shadows.order[pNext[sortRays ? emitter : 0]++] = uint32_t(slot);
+                    }
+                }
+            }
+        });
+    }
+
+    // Turn runCounts, laid out chunk by chunk with runsPerChunk runs each, into runStarts: where each run begins
+    // when runs are taken in run order and chunk order within a run.  Returns the total
+    uint32_t PrefixSum(size_t chunks, size_t runsPerChunk)
+    {
+        runStarts.resize(runCounts.size());
+        uint32_t total = 0;
+        for (size_t run = 0; run < runsPerChunk; run++)
+        {
+            for (size_t chunk = 0; chunk < chunks; chunk++)
+            {
+                runStarts[chunk * runsPerChunk + run] = total;
+                total += runCounts[chunk * runsPerChunk + run];
+            }
+        }
+        return total;
+    }
+
+    // Shadow: any hit test for every shadow ray shading asked for
+    void Shadow()
+    {
+        pool.For(shadows.order.size(), [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+            {
+                uint32_t slot = shadows.order[i];
+                vec3 origin = shadows.Origin(slot);
+                vec3 dir = shadows.Direction(slot);
+                bool occluded = false;
+                for (uint32_t id = 0; id < uint32_t(sceneObjects.size()) && !occluded; id++)
+                {
+                    HitRecord hit;
+                    occluded = id != shadows.emitterId[slot] &&
+                        sceneObjects[id]->Intersects(origin, dir, hit) &&
+                        hit.distance < shadows.maxDistance[slot];
+                }
+                shadows.visible[slot] = occluded ? 0 : 1;
+            }
+        });
+    }
+
+    // Accumulate: add the light that got through.  Each ray owns its own slots and its own path
+    void Accumulate(size_t emitterCount)
+    {
+        pool.For(rays.Size(), [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+            {
+                for (size_t slot = i * emitterCount; slot < (i + 1) * emitterCount; slot++)
+                {
+                    if (shadows.active[slot] && shadows.visible[slot])
+                    {
+                        radiance[rays.path[i]] += shadows.contribution[slot];
+                    }
+                }
+            }
+        });
+    }
+
+    // Gather the surviving reflection rays into the queue for the next depth; bucketed by direction and origin
+    // when sorting, since reflections scatter and traced in path order would touch the scene at random.  Chunks
+    // count their survivors and are placed by a prefix sum, like the shadow rays
+    void Compact()
+    {
+        const size_t chunks = size_t(pool.Size());
+        runCounts.assign(chunks, 0);
+        std::vector<BoundingBox> chunkBounds(chunks);
+        pool.ForChunks(rays.Size(), [&](int chunk, size_t begin, size_t end)
+        {
+            uint32_t count = 0;
+            for (size_t i = begin; i < end; i++)
+            {
+                if (continues[i])
+                {
+                    count++;
+                    chunkBounds[chunk].Extend(nextRays[i].origin);
+                }
+            }
+            runCounts[chunk] = count;
+        });
+
+        keys.resize(PrefixSum(chunks, 1));
+        BoundingBox bounds;
+        for (auto& box : chunkBounds)
+        {
+            bounds.Extend(box);
+        }
+
+        pool.ForChunks(rays.Size(), [&](int chunk, size_t begin, size_t end)
+        {
+            uint32_t next = runStarts[chunk];
+            for (size_t i = begin; i < end; i++)
+            {
+                if (continues[i])
+                {
+                    uint64_t key = i;
+                    if (sortRays)
+                    {
+                        key |= uint64_t(CoherenceKey(nextRays[i].origin, nextRays[i].direction, bounds)) << 32;
+                    }
+                    keys[next++] = key;
+                }
+            }
+        });
+
+        if (sortRays)
+        {
+            std::sort(keys.begin(), keys.end());
+        }
+
+        RayQueue next;
+        next.Resize(keys.size());
+        pool.For(keys.size(), [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+            {
+                uint32_t ray = uint32_t(keys[i]);
+                next.Set(i, rays.path[ray], nextRays[ray].origin, nextRays[ray].direction, nextRays[ray].throughput);
+            }
+        });
+        rays = std::move(next);
+    }
+
+    // Paths per batch; keeps the queues a manageable size however large the image
+    static const size_t BatchSize = 1 << 16;
+
+    const std::vector<std::shared_ptr<SceneObject>>& sceneObjects;
+    const MaterialTable& materials;
+    PathSettings pathSettings;
+    vec3 backgroundColor;
+    int maxDepth;
+    WorkerPool pool;
+    bool sortRays;
+    std::vector<uint32_t> emitters;     // Ids of the objects that may emit
+
+    RayQueue rays;
+    std::vector<HitRecord> hits;
+    ShadowQueue shadows;
+    std::vector<PathState> nextRays;
+    std::vector<uint8_t> continues;
+    std::vector<vec3> radiance;         // Per path in the batch
+    std::vector<uint64_t> keys;         // Sort key << 32 | index, for reordering queues
+    std::vector<uint32_t> runCounts;    // Per chunk of a parallel loop, items it found
+    std::vector<uint32_t> runStarts;    // And where they go, from the prefix sum
+};
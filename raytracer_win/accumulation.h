@@ -0,0 +1,125 @@
+#pragma once
+
+#include <string>
+
+// Progressive accumulation.
+// Each pixel keeps the sum of its samples and how many there were; the average is only taken when the image is
+// shown.  Adding a sample touches just its own pixel, so pixels can take different numbers of samples, and a
+// pass that skips pixels costs nothing for them.  Float sums lose the low bits of each new sample once they grow
+// large, so the sums can be kept in double precision, or in float with Kahan compensation for the lost bits.
+
+enum class AccumulationType
+{
+    Float,          // Plain float sums
+    Double,         // Double precision sums
+    Compensated     // Float sums with a running correction (Kahan)
+};
+
+// Look up an accumulation type by name: float, double or compensated.  Fails if there isn't one
+inline bool FindAccumulation(const std::string& name, AccumulationType& type)
+{
+    if (name == "float")
+    {
+        type = AccumulationType::Float;
+    }
+    else if (name == "double")
+    {
+        type = AccumulationType::Double;
+    }
+    else if (name == "compensated")
+    {
+        type = AccumulationType::Compensated;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+class AccumulationBuffer
+{
+public:
+    void Resize(int pixelCount, AccumulationType accumulationType)
+    {
+        type = accumulationType;
+        counts.assign(pixelCount, 0);
+        floatSums.assign(type == AccumulationType::Double ? 0 : pixelCount, glm::vec3(0.0f));
+        compensation.assign(type == AccumulationType::Compensated ? pixelCount : 0, glm::vec3(0.0f));
+        doubleSums.assign(type == AccumulationType::Double ? pixelCount : 0, glm::dvec3(0.0));
+    }
+
+    // Forget every sample
+    void Reset()
+    {
+        std::fill(counts.begin(), counts.end(), 0u);
+        std::fill(floatSums.begin(), floatSums.end(), glm::vec3(0.0f));
+        std::fill(compensation.begin(), compensation.end(), glm::vec3(0.0f));
+        std::fill(doubleSums.begin(), doubleSums.end(), glm::dvec3(0.0));
+    }
+
+    // Start a pixel from a color already worth some samples
+    void Seed(int index, const glm::vec3& color, uint32_t count)
+    {
+        counts[index] = count;
+        if (type == AccumulationType::Double)
+        {
+            doubleSums[index] = glm::dvec3(color) * double(count);
+            return;
+        }
+        floatSums[index] = color * float(count);
+        if (type == AccumulationType::Compensated)
+        {
+            compensation[index] = glm::vec3(0.0f);
+        }
+    }
+
+    // Add a sample to a pixel.  Returns how many it now has
+    uint32_t Add(int index, const glm::vec3& color)
+    {
+        switch (type)
+        {
+        case AccumulationType::Double:
+            doubleSums[index] += glm::dvec3(color);
+            break;
+        case AccumulationType::Compensated:
+        {
+            glm::vec3 y = color - compensation[index];
+            glm::vec3 t = floatSums[index] + y;
+            compensation[index] = (t - floatSums[index]) - y;
+            floatSums[index] = t;
+            break;
+        }
+        default:
+            floatSums[index] += color;
+            break;
+        }
+        return ++counts[index];
+    }
+
+    uint32_t Count(int index) const
+    {
+        return counts[index];
+    }
+
+    // The average of a pixel's samples, or black if it has none
+    glm::vec3 Mean(int index) const
+    {
+        if (counts[index] == 0)
+        {
+            return glm::vec3(0.0f);
+        }
+        if (type == AccumulationType::Double)
+        {
+            return glm::vec3(doubleSums[index] / double(counts[index]));
+        }
+        return floatSums[index] / float(counts[index]);
+    }
+
+private:
+    AccumulationType type = AccumulationType::Double;
+    std::vector<uint32_t> counts;
+    std::vector<glm::vec3> floatSums;       // Float and compensated
+    std::vector<glm::vec3> compensation;    // The low bits the float sums lost; compensated only
+    std::vector<glm::dvec3> doubleSums;
+};
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <atomic>
+#include <limits>
+
+// Adaptive sampling.
+// Each pixel keeps a running variance of its samples' luminance (Welford), so the standard error of its mean
+// is known as it accumulates.  A pixel stops taking samples once it has had a minimum number and its relative
+// error is below the threshold, and a tile is skipped altogether once all its pixels have.  Flat regions, the
+// sky and anything a single sample already gets right converge after the minimum, so later passes only cost
+// what the noisy parts of the image need.
+
+class ConvergenceMap
+{
+public:
+    static const int TileSize = 16;
+
+    void Resize(int imageWidth, int imageHeight)
+    {
+        width = imageWidth;
+        height = imageHeight;
+        tilesX = (width + TileSize - 1) / TileSize;
+        tilesY = (height + TileSize - 1) / TileSize;
+        pixels.assign(size_t(width) * size_t(height), PixelStats());
+        converged.assign(size_t(tilesX) * size_t(tilesY), 0);
+        activeTiles = tilesX * tilesY;
+    }
+
+    // Forget every sample; all tiles render again
+    void Reset()
+    {
+        std::fill(pixels.begin(), pixels.end(), PixelStats());
+        std::fill(converged.begin(), converged.end(), uint8_t(0));
+        activeTiles = tilesX * tilesY;
+    }
+
+    // Relative standard error a tile must reach, and the samples each pixel takes before it counts.
+    // A threshold of 0 never stops
+    void SetThreshold(float errorThreshold, uint32_t samples)
+    {
+        threshold = errorThreshold;
+        minSamples = std::max(2u, samples);
+    }
+
+    int TileCount() const
+    {
+        return tilesX * tilesY;
+    }
+
+    int ActiveTiles() const
+    {
+        return activeTiles;
+    }
+
+    bool IsConverged(int tile) const
+    {
+        return converged[tile] != 0;
+    }
+
+    // The pixels a tile covers, [x0, x1) by [y0, y1)
+    void TileBounds(int tile, int& x0, int& y0, int& x1, int& y1) const
+    {
+        x0 = (tile % tilesX) * TileSize;
+        y0 = (tile / tilesX) * TileSize;
+        x1 = std::min(x0 + TileSize, width);
+        y1 = std::min(y0 + TileSize, height);
+    }
+
+    // Add a sample's luminance to a pixel.  Returns how many samples it now has
+    uint32_t AddSample(int index, float luminance)
+    {
+        auto& stats = pixels[index];
+        stats.count++;
+        float delta = luminance - stats.mean;
+        stats.mean += delta / float(stats.count);
+        stats.m2 += delta * (luminance - stats.mean);
+        return stats.count;
+    }
+
+    // Samples the pixel has taken since the last reset
+    uint32_t SampleCount(int index) const
+    {
+        return pixels[index].count;
+    }
+
+    // Standard error of the pixel's mean, relative to its brightness; dark pixels are measured against a floor,
+    // so noise that can't be seen doesn't keep them going
+    float RelativeError(int index) const
+    {
+        auto& stats = pixels[index];
+        if (stats.count < minSamples)
+        {
+            return std::numeric_limits<float>::max();
+        }
+        float variance = stats.m2 / float(stats.count - 1);
+        return std::sqrt(variance / float(stats.count)) / (stats.mean + 0.1f);
+    }
+
+    bool IsPixelConverged(int index) const
+    {
+        return threshold > 0.0f && RelativeError(index) < threshold;
+    }
+
+    // Called by the thread that rendered the tile, with the worst error of its pixels
+    void UpdateTile(int tile, float maxError)
+    {
+        if (threshold > 0.0f && maxError < threshold)
+        {
+            converged[tile] = 1;
+            activeTiles--;
+        }
+    }
+
+private:
+    struct PixelStats
+    {
+        uint32_t count = 0;
+        float mean = 0.0f;      // Of the luminance
+        float m2 = 0.0f;        // Sum of squared differences from the mean
+    };
+
+    int width = 0;
+    int height = 0;
+    int tilesX = 0;
+    int tilesY = 0;
+    float threshold = 0.0f;
+    uint32_t minSamples = 2;
+    std::vector<PixelStats> pixels;
+    std::vector<uint8_t> converged;    // Per tile; bytes, since threads set neighbouring tiles at once
+    std::atomic<int> activeTiles{ 0 };
+};
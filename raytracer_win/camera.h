@@ -57,6 +57,14 @@ private:
 
     glm::quat orientation;                                          // A quaternion representing the camera rotation
 
+    // Raster to world, worked out once per frame: the (unnormalized) direction through raster (0, 0),
+    // how far it moves per pixel across and down, and the distance to the plane of focus
+    glm::vec3 rasterOrigin = glm::vec3(0.0f);
+    glm::vec3 pixelDeltaX = glm::vec3(0.0f);
+    glm::vec3 pixelDeltaY = glm::vec3(0.0f);
+    float focalDistance = 1.0f;
+    float lensRadius = 0.14f;                                       // Radius of the aperture, for depth of field
+
     glm::vec2 orbitDelta = glm::vec2(0.0f);
     glm::vec3 positionDelta = glm::vec3(0.0f);
 
@@ -95,12 +103,23 @@ public:
         UpdateRightUp();
     }
 
+    // Radius of the aperture; 0 for a pinhole, with everything in focus
+    void SetLensRadius(float radius)
+    {
+        lensRadius = radius;
+    }
+
+    float GetLensRadius() const
+    {
+        return lensRadius;
+    }
+
     void SetFilmSize(float width, float height)
     {
         filmWidth = width;
         filmHeight = height;
         aspectRatio = width / height;
-
+        UpdateRaster();
     }
 
     bool PreRender()
@@ -143,33 +162,29 @@ public:
         return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
     }
 
-    // Given a screen coordinate, return a ray leaving the camera and entering the world at that 'pixel'
-    Ray GetWorldRay(const glm::vec2& imageSample)
+    // Given a screen coordinate, return a ray leaving the camera and entering the world at that 'pixel'.
+    // The lens sample, in [0, 1)^2, picks where on the aperture it starts
+    Ray GetWorldRay(const glm::vec2& imageSample, const glm::vec2& lensSample) const
     {
-        // Could move some of this maths out of here for speed, but this isn't time critical
-        //glm::vec3 dir(viewDirection);
-       
-
-        auto lensRand = glm::circularRand(0.14f);
-
-        auto dir = viewDirection;
-        float x = ((imageSample.x * 2.0f) / filmWidth) - 1.0f;
-        float y = ((imageSample.y * 2.0f) / filmHeight) - 1.0f;
-
-        // Take the view direction and adjust it to point at the given sample, based on the 
-        // the frustum 
-        dir += (right * (halfAngle * aspectRatio * x));
-        dir -= (up * (halfAngle * y));
-        //dir = normalize(dir);
-        float ft = (glm::length(focalPoint - position) - 1.0f) / glm::length(dir);
-        glm::vec3 focasPoint = position + dir * ft;
+        return GetLensRay(rasterOrigin + (pixelDeltaX * imageSample.x) + (pixelDeltaY * imageSample.y), lensSample);
+    }
 
-        glm::vec3 lensPoint = position;
-        lensPoint += (right * lensRand.x);
-        lensPoint += (up * lensRand.y);
-        dir = glm::normalize(focasPoint - lensPoint);
+    // The screen coordinate a world point is seen at through the center of the lens; the inverse of GetWorldRay.
+    // Fails for points behind the camera
+    bool WorldToRaster(const glm::vec3& point, glm::vec2& raster) const
+    {
+        glm::vec3 dir = point - position;
+        float depth = glm::dot(dir, viewDirection);
+        if (depth <= 0.0f)
+        {
+            return false;
+        }
 
-        return Ray{ lensPoint, dir };
+        // On the plane one unit in front, where the raster origin and steps are
+        glm::vec3 onPlane = (dir / depth) - rasterOrigin;
+        raster = glm::vec2(glm::dot(onPlane, pixelDeltaX) / glm::dot(pixelDeltaX, pixelDeltaX),
+            glm::dot(onPlane, pixelDeltaY) / glm::dot(pixelDeltaY, pixelDeltaY));
+        return true;
     }
 
     void Dolly(float distance)
@@ -238,5 +253,49 @@ private:
         // Right and up vectors updated based on the quaternion orientation
         right = glm::normalize(glm::vec3(1.0f, 0.0f, 0.0f) * orientation);
         up = glm::normalize(glm::vec3(0.0f, 1.0f, 0.0f) * orientation);
+        UpdateRaster();
+    }
+
+    // Fold the frustum mapping into a corner and two steps, for this frame's view
+    void UpdateRaster()
+    {
+        pixelDeltaX = right * (halfAngle * aspectRatio * 2.0f / filmWidth);
+        pixelDeltaY = -up * (halfAngle * 2.0f / filmHeight);
+        rasterOrigin = viewDirection - (right * (halfAngle * aspectRatio)) + (up * halfAngle);
+        focalDistance = glm::length(focalPoint - position) - 1.0f;
+    }
+
+    // Depth of field: from a point on the lens, through where the pinhole ray meets the plane of focus.
+    // The square sample is mapped to the disc concentrically (Shirley and Chiu), which keeps its strata intact
+    Ray GetLensRay(const glm::vec3& dir, const glm::vec2& lensSample) const
+    {
+        glm::vec2 offset = lensSample * 2.0f - glm::vec2(1.0f);
+        glm::vec2 lensRand(0.0f);
+        if (offset.x != 0.0f || offset.y != 0.0f)
+        {
+            const float quarterPi = glm::pi<float>() * 0.25f;
+            float radius;
+            float theta;
+            if (std::abs(offset.x) > std::abs(offset.y))
+            {
+                radius = offset.x;
+                theta = quarterPi * (offset.y / offset.x);
+            }
+            else
+            {
+                radius = offset.y;
+                theta = 2.0f * quarterPi - quarterPi * (offset.x / offset.y);
+            }
+            lensRand = glm::vec2(std::cos(theta), std::sin(theta)) * (radius * lensRadius);
+        }
+
+        float ft = focalDistance / glm::length(dir);
+        glm::vec3 focusPoint = position + dir * ft;
+
+        glm::vec3 lensPoint = position;
+        lensPoint += (right * lensRand.x);
+        lensPoint += (up * lensRand.y);
+
+        return Ray{ lensPoint, glm::normalize(focusPoint - lensPoint) };
     }
 };
@@ -0,0 +1,60 @@
+#pragma once
+
+// Primary hit cache.
+// While the camera holds still and there is no depth of field, every pass traces the same camera rays, apart
+// from where in the pixel they start.  So the sub pixel positions cycle through a small fixed set, and each
+// pixel keeps every position with the hit record of its ray through it.  After the first few passes no camera
+// ray is traced: the integrators start from the cached hit, at shading and the secondary rays.
+// Anything that changes the view restarts accumulation, and clears the cache with it.
+
+struct CachedHit
+{
+    glm::vec2 pixelSample = glm::vec2(0.0f);    // Where in the pixel the ray starts
+    HitRecord hit;
+};
+
+class PrimaryHitCache
+{
+public:
+    // Sub pixel positions per pixel; 0 turns the cache off
+    void Resize(int pixelCount, int positionCount)
+    {
+        positions = std::max(0, positionCount);
+        hits.assign(size_t(pixelCount) * size_t(positions), CachedHit());
+        known.assign(hits.size(), 0);
+    }
+
+    void Clear()
+    {
+        std::fill(known.begin(), known.end(), uint8_t(0));
+    }
+
+    bool Enabled() const
+    {
+        return positions > 0;
+    }
+
+    // Which of the fixed positions a pixel's sample uses
+    uint32_t Position(uint32_t sampleIndex) const
+    {
+        return sampleIndex % uint32_t(positions);
+    }
+
+    // One of a pixel's positions and its hit, filled in by the given function the first time
+    template <typename FindHit>
+    const CachedHit& Get(int index, uint32_t position, const FindHit& findHit)
+    {
+        size_t slot = (size_t(index) * size_t(positions)) + position;
+        if (!known[slot])
+        {
+            findHit(hits[slot]);
+            known[slot] = 1;
+        }
+        return hits[slot];
+    }
+
+private:
+    int positions = 0;
+    std::vector<CachedHit> hits;
+    std::vector<uint8_t> known;
+};
@@ -0,0 +1,231 @@
+#pragma once
+
+// A light hierarchy, for scenes with many emitters.
+// Emissive spheres are gathered into a binary tree, each node bounding the positions, total power and emission
+// directions of the lights below it.  To light a point we walk down from the root, choosing a child with
+// probability proportional to an estimate of what it could contribute, and shade only the light we reach,
+// divided by the probability of picking it.  The cost per hit grows with the depth of the tree, not the number
+// of lights, and the average over many samples is the full sum.
+// Emitters that aren't spheres stay out of the tree and are shaded at every hit, as before; objects that can't
+// emit at all are left out of both.
+
+struct LightNode
+{
+    glm::vec3 boundsMin;                                // Around the light centers
+    glm::vec3 boundsMax;
+    float radius = 0.0f;                                // Largest light radius, to grow the bounds by
+    float power = 0.0f;                                 // Summed emission
+    glm::vec3 axis = glm::vec3(0.0f, 1.0f, 0.0f);       // Emission directions lie within cosSpread of the axis
+    float cosSpread = -1.0f;                            // Spheres shine every way
+    uint32_t children[2] = { 0, 0 };
+    uint32_t emitterId = NoPrimitive;                   // Leaves only: the scene object
+};
+
+struct LightSample
+{
+    uint32_t emitterId;
+    float pdf;                  // Chance of having picked this light
+};
+
+class LightTree
+{
+public:
+    void Build(const std::vector<std::shared_ptr<SceneObject>>& objects, const MaterialTable& materials)
+    {
+        nodes.clear();
+        unsampled.clear();
+
+        std::vector<LightNode> leaves;
+        for (uint32_t id = 0; id < uint32_t(objects.size()); id++)
+        {
+            auto pSphere = dynamic_cast<const Sphere*>(objects[id].get());
+            if (!pSphere)
+            {
+                if (objects[id]->MayEmit(materials))
+                {
+                    unsampled.push_back(id);
+                }
+                continue;
+            }
+
+            // Spheres that don't glow can't light anything
+            const glm::vec3& emissive = materials[pSphere->material].emissive;
+            if (emissive == glm::vec3(0.0f))
+            {
+                continue;
+            }
+
+            LightNode leaf;
+            leaf.boundsMin = pSphere->center;
+            leaf.boundsMax = pSphere->center;
+            leaf.radius = pSphere->radius;
+            leaf.power = emissive.r + emissive.g + emissive.b;
+            leaf.emitterId = id;
+            leaves.push_back(leaf);
+        }
+
+        if (!leaves.empty())
+        {
+            nodes.reserve(leaves.size() * 2);
+            BuildNode(leaves, 0, leaves.size());
+        }
+    }
+
+    bool Empty() const
+    {
+        return nodes.empty();
+    }
+
+    // Emitters the tree doesn't cover, to be shaded every time
+    const std::vector<uint32_t>& GetUnsampled() const
+    {
+        return unsampled;
+    }
+
+    // Pick a light for the point, in proportion to what it might add, with a uniform sample u.  Fails if
+    // nothing can light it
+    bool Sample(const glm::vec3& pos, const glm::vec3& normal, float u, LightSample& sample) const
+    {
+        if (nodes.empty() || Importance(nodes[0], pos, normal) <= 0.0f)
+        {
+            return false;
+        }
+
+        uint32_t index = 0;
+        float pdf = 1.0f;
+        while (nodes[index].emitterId == NoPrimitive)
+        {
+            const LightNode& node = nodes[index];
+            float left = Importance(nodes[node.children[0]], pos, normal);
+            float right = Importance(nodes[node.children[1]], pos, normal);
+            if (left + right <= 0.0f)
+            {
+                return false;
+            }
+
+            // Each choice only uses part of u; what's left of it is stretched back over [0, 1) for the next
+            float pickLeft = left / (left + right);
+            if (u < pickLeft)
+            {
+                index = node.children[0];
+                pdf *= pickLeft;
+                u = u / pickLeft;
+            }
+            else
+            {
+                index = node.children[1];
+                pdf *= 1.0f - pickLeft;
+                u = (u - pickLeft) / (1.0f - pickLeft);
+            }
+            u = std::min(u, 0.99999994f);
+        }
+
+        sample.emitterId = nodes[index].emitterId;
+        sample.pdf = pdf;
+        return true;
+    }
+
+private:
+    // Split the leaves at the median of the widest axis of their centers.  Returns the node index
+    uint32_t BuildNode(std::vector<LightNode>& leaves, size_t begin, size_t end)
+    {
+        uint32_t index = uint32_t(nodes.size());
+        if (end - begin == 1)
+        {
+            nodes.push_back(leaves[begin]);
+            return index;
+        }
+
+        nodes.push_back(LightNode());
+        LightNode node;
+        node.boundsMin = leaves[begin].boundsMin;
+        node.boundsMax = leaves[begin].boundsMax;
+        for (size_t i = begin; i < end; i++)
+        {
+            node.boundsMin = glm::min(node.boundsMin, leaves[i].boundsMin);
+            node.boundsMax = glm::max(node.boundsMax, leaves[i].boundsMax);
+            node.radius = std::max(node.radius, leaves[i].radius);
+            node.power += leaves[i].power;
+        }
+
+        glm::vec3 extent = node.boundsMax - node.boundsMin;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        size_t middle = begin + (end - begin) / 2;
+        std::nth_element(leaves.begin() + begin, leaves.begin() + middle, leaves.begin() + end, [axis](const LightNode& a, const LightNode& b)
+        {
+            return a.boundsMin[axis] < b.boundsMin[axis];
+        });
+
+        node.children[0] = BuildNode(leaves, begin, middle);
+        node.children[1] = BuildNode(leaves, middle, end);
+
+        // Emission cones only ever widen going up; for spheres they are already everything
+        node.axis = nodes[node.children[0]].axis;
+        node.cosSpread = std::min(nodes[node.children[0]].cosSpread, nodes[node.children[1]].cosSpread);
+        if (glm::dot(nodes[node.children[0]].axis, nodes[node.children[1]].axis) < 1.0f)
+        {
+            node.cosSpread = -1.0f;
+        }
+
+        nodes[index] = node;
+        return index;
+    }
+
+    // What the lights under a node could add at a point: power times bounds on the cosines at the receiver and
+    // the emitter.  The shading takes a light's emission through the Phong terms, with no falloff or size, so
+    // neither does this.  It must only be zero when the real contribution is
+    static float Importance(const LightNode& node, const glm::vec3& pos, const glm::vec3& normal)
+    {
+        glm::vec3 center = (node.boundsMin + node.boundsMax) * 0.5f;
+        float boundRadius = glm::length(node.boundsMax - node.boundsMin) * 0.5f + node.radius;
+
+        glm::vec3 toLights = center - pos;
+        float distance = glm::length(toLights);
+        if (distance <= boundRadius)
+        {
+            // Inside the bounds; any direction is possible
+            return node.power;
+        }
+        toLights /= distance;
+
+        // The widest the bounds look from here
+        float sinBound = boundRadius / distance;
+        float cosBound = std::sqrt(1.0f - sinBound * sinBound);
+
+        // cos(max(angle - bound, 0)), with the surface normal at the receiver
+        float cosReceiver = CosMinusBound(glm::dot(normal, toLights), sinBound, cosBound);
+        if (cosReceiver <= 0.0f)
+        {
+            return 0.0f;
+        }
+
+        // And with the emission cone, widened by its spread
+        float cosEmitter = 1.0f;
+        if (node.cosSpread > -1.0f)
+        {
+            float cosTheta = CosMinusBound(glm::dot(node.axis, -toLights), sinBound, cosBound);
+            float sinSpread = std::sqrt(std::max(0.0f, 1.0f - node.cosSpread * node.cosSpread));
+            cosEmitter = CosMinusBound(cosTheta, sinSpread, node.cosSpread);
+            if (cosEmitter <= 0.0f)
+            {
+                return 0.0f;
+            }
+        }
+
+        return node.power * cosReceiver * cosEmitter;
+    }
+
+    // cos(max(theta - bound, 0)), from the cosine of theta and the sine and cosine of the bound
+    static float CosMinusBound(float cosTheta, float sinBound, float cosBound)
+    {
+        if (cosTheta >= cosBound)
+        {
+            return 1.0f;
+        }
+        float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+        return cosTheta * cosBound + sinTheta * sinBound;
+    }
+
+    std::vector<LightNode> nodes;       // Root first
+    std::vector<uint32_t> unsampled;
+};
@@ -17,6 +17,18 @@ using namespace Gdiplus;
 #include "sceneobjects.h"
 #include "camera.h"
 #include "manipulator.h"
+#include "pathstate.h"
+#include "sampler.h"
+#include "lights.h"
+#include "occludercache.h"
+#include "pathtracing.h"
+#include "integrator.h"
+#include "adaptive.h"
+#include "accumulation.h"
+#include "reprojection.h"
+#include "refinement.h"
+#include "region.h"
+#include "hitcache.h"
 
 #include <thread>
 #include <chrono>
@@ -32,9 +44,36 @@ HWND hWnd;
 
 #define MAX_DEPTH 3
 
+// The path tracer needs more bounces than the reflections do, to carry light between diffuse surfaces
+#define PATH_DEPTH 8
+
 std::shared_ptr<Bitmap> spBitmap;
-std::vector<glm::vec4> buffer;
+AccumulationBuffer buffer;
+AccumulationType accumulationType = AccumulationType::Double;
 std::vector<std::shared_ptr<SceneObject>> sceneObjects;
+MaterialTable materials;
+PathSettings pathSettings;
+LightTree lightTree;
+int lightSamples = 0;   // Lights picked from the tree per hit; 0 shades them all
+bool useOccluderCache = true;
+SamplerType samplerType = SamplerType::Sobol;
+int ambientOcclusionSamples = 4;        // Rays cast from each hit in the ao mode
+float ambientOcclusionDistance = 1.5f;  // And how far they look
+EmitterSampler emitterSampler;
+std::unique_ptr<Integrator> pIntegrator;
+ConvergenceMap convergence;
+Reprojection reprojection;
+bool reprojectOnMove = true;
+ProgressiveResolution resolution;
+PrimaryHitCache hitCache;
+int hitCachePositions = 4;              // Sub pixel positions cached per pixel; 0 for none
+PixelRect renderRegion;                 // Empty for the whole image
+Foveation foveation;
+float foveationRadius = 0.0f;
+bool focusPicked = false;               // The focus was clicked on, rather than following the region
+bool draggingRegion = false;
+glm::ivec2 regionDragStart;
+glm::ivec2 regionDragEnd;
 std::shared_ptr<Camera> pCamera;
 std::shared_ptr<Manipulator> pManipulator;
 
@@ -42,12 +81,35 @@ float cameraAngle = 0.0f;
 float cameraDistance = 8.0f;
 
 void DrawScene(int partitions, bool antialias);
+
+// A color for a pixel with no samples yet: the average of its neighbours that have some, when checkerboard
+// passes have left it out, or its block's, during the coarse passes
+glm::vec3 MissingPixelColor(int x, int y)
+{
+    glm::vec3 sum(0.0f);
+    int count = 0;
+    const glm::ivec2 neighbours[] = { glm::ivec2(-1, 0), glm::ivec2(1, 0), glm::ivec2(0, -1), glm::ivec2(0, 1) };
+    for (auto& offset : neighbours)
+    {
+        int nx = x + offset.x;
+        int ny = y + offset.y;
+        if (nx >= 0 && ny >= 0 && nx < ImageWidth && ny < ImageHeight && buffer.Count((ny * ImageWidth) + nx) > 0)
+        {
+            sum += buffer.Mean((ny * ImageWidth) + nx);
+            count++;
+        }
+    }
+    if (count > 0)
+    {
+        return sum / float(count);
+    }
+    return buffer.Mean(ProgressiveResolution::StandIn(x, y, ImageWidth, [](int i) { return buffer.Count(i) > 0; }));
+}
+
 void CopyTargetToBitmap()
 {
     if (spBitmap)
     {
-        auto pData = &buffer[0];
-
         BitmapData writeData;
         Rect lockRect(0, 0, ImageWidth, ImageHeight);
         if (spBitmap->LockBits(&lockRect, ImageLockModeWrite, PixelFormat32bppARGB, &writeData) == 0)
@@ -58,7 +120,8 @@ void CopyTargetToBitmap()
                 for (auto x = 0; x < int(writeData.Width); x++)
                 {
                     glm::u8vec4* pTarget = (glm::u8vec4*)((uint8_t*)writeData.Scan0 + (y * writeData.Stride) + (x * 4));
-                    glm::vec4 source = buffer[(y * ImageWidth) + x];
+                    int index = (y * ImageWidth) + x;
+                    glm::vec4 source = glm::vec4(buffer.Count(index) > 0 ? buffer.Mean(index) : MissingPixelColor(x, y), 1.0f);
                     source = glm::clamp(source, glm::vec4(0.0f), glm::vec4(1.0f));
 
                     source = glm::u8vec4(source * 255.0f);
@@ -76,6 +139,42 @@ bool step = true;
 bool sizeChanged = true;
 int currentSample = 0;
 
+bool InRenderRegion(int x, int y)
+{
+    return renderRegion.Empty() || renderRegion.Contains(x, y);
+}
+
+// Foveate around the clicked point, or else the middle of the region or image
+void UpdateFocus(const glm::vec2* pPicked = nullptr)
+{
+    glm::vec2 focus = foveation.Focus();
+    if (pPicked)
+    {
+        focus = *pPicked;
+        focusPicked = true;
+    }
+    else if (!focusPicked)
+    {
+        focus = renderRegion.Empty() ? glm::vec2(float(ImageWidth), float(ImageHeight)) * 0.5f :
+            glm::vec2(float(renderRegion.x0 + renderRegion.x1), float(renderRegion.y0 + renderRegion.y1)) * 0.5f;
+    }
+    foveation.Set(focus, foveationRadius);
+}
+
+// The rectangle between two corners of a drag, or an empty one for a click
+PixelRect RegionFromDrag(const glm::ivec2& a, const glm::ivec2& b)
+{
+    PixelRect rect;
+    if (std::abs(a.x - b.x) >= 4 && std::abs(a.y - b.y) >= 4)
+    {
+        rect.x0 = std::max(0, std::min(a.x, b.x));
+        rect.y0 = std::max(0, std::min(a.y, b.y));
+        rect.x1 = std::min(ImageWidth, std::max(a.x, b.x));
+        rect.y1 = std::min(ImageHeight, std::max(a.y, b.y));
+    }
+    return rect;
+}
+
 VOID OnPaint(HDC hdc)
 {
     Graphics graphics(hdc);
@@ -92,6 +191,14 @@ VOID OnPaint(HDC hdc)
     if (spBitmap)
     {
         graphics.DrawImage(spBitmap.get(), dest, 0.0f, 0.0f, float(ImageWidth), float(ImageHeight), Unit(UnitPixel));
+
+        // Outline the render region, or the one being dragged out
+        PixelRect outline = draggingRegion ? RegionFromDrag(regionDragStart, regionDragEnd) : renderRegion;
+        if (!outline.Empty())
+        {
+            Pen pen(Color(255, 255, 255, 0));
+            graphics.DrawRectangle(&pen, outline.x0, outline.y0, outline.x1 - outline.x0 - 1, outline.y1 - outline.y0 - 1);
+        }
     }
     else
     {
@@ -102,7 +209,10 @@ VOID OnPaint(HDC hdc)
 void InitMaps()
 {
     spBitmap = std::make_shared<Bitmap>(ImageWidth, ImageHeight, PixelFormat32bppPARGB);
-    buffer.resize(ImageWidth * ImageHeight, glm::vec4(0));
+    buffer.Resize(ImageWidth * ImageHeight, accumulationType);
+    convergence.Resize(ImageWidth, ImageHeight);
+    reprojection.Resize(ImageWidth, ImageHeight);
+    hitCache.Resize(ImageWidth * ImageHeight, hitCachePositions);
     currentSample = 0;
 }
 
@@ -110,42 +220,56 @@ void InitMaps()
 void InitScene()
 {
     sceneObjects.clear();
+    materials.Clear();
 
     // Red ball
     Material mat;
     mat.albedo = glm::vec3(.7f, .1f, .1f);
     mat.specular = glm::vec3(.9f, .1f, .1f);
     mat.reflectance = 0.5f;
-    sceneObjects.push_back(std::make_shared<Sphere>(mat, glm::vec3(0.0f, 2.0f, 0.f), 2.0f));
+    sceneObjects.push_back(std::make_shared<Sphere>(materials.Add(mat), glm::vec3(0.0f, 2.0f, 0.f), 2.0f));
 
     // Purple ball
     mat.albedo = glm::vec3(0.7f, 0.0f, 0.7f);
     mat.specular = glm::vec3(0.9f, 0.9f, 0.8f);
     mat.reflectance = 0.5f;
-    sceneObjects.push_back(std::make_shared<Sphere>(mat, glm::vec3(-2.5f, 1.0f, 2.f), 1.0f));
+    sceneObjects.push_back(std::make_shared<Sphere>(materials.Add(mat), glm::vec3(-2.5f, 1.0f, 2.f), 1.0f));
 
     // Blue ball
     mat.albedo = glm::vec3(0.0f, 0.3f, 1.0f);
     mat.specular = glm::vec3(0.0f, 0.0f, 1.0f);
     mat.reflectance = 0.0f;
     mat.emissive = glm::vec3(0.0f, 0.0f, 0.0f);
-    sceneObjects.push_back(std::make_shared<Sphere>(mat, glm::vec3(0.0f, 0.5f, 3.f), 0.5f));
+    sceneObjects.push_back(std::make_shared<Sphere>(materials.Add(mat), glm::vec3(0.0f, 0.5f, 3.f), 0.5f));
 
     // White ball
     mat.albedo = glm::vec3(1.0f, 1.0f, 1.0f);
     mat.specular = glm::vec3(0.0f, 0.0f, 0.0f);
     mat.reflectance = .0f;
     mat.emissive = glm::vec3(0.0f, 0.8f, 0.8f);
-    sceneObjects.push_back(std::make_shared<Sphere>(mat, glm::vec3(2.8f, 0.8f, 2.0f), 0.8f));
+    sceneObjects.push_back(std::make_shared<Sphere>(materials.Add(mat), glm::vec3(2.8f, 0.8f, 2.0f), 0.8f));
 
     // White light
     mat.albedo = glm::vec3(0.0f, 0.8f, 0.0f);
     mat.specular = glm::vec3(0.0f, 0.0f, 0.0f);
     mat.reflectance = 0.0f;
     mat.emissive = glm::vec3(1.0f, 1.0f, 1.0f);
-    sceneObjects.push_back(std::make_shared<Sphere>(mat, glm::vec3(-0.8f, 10.4f, 8.0f), 1.0f));
+    sceneObjects.push_back(std::make_shared<Sphere>(materials.Add(mat), glm::vec3(-0.8f, 10.4f, 8.0f), 1.0f));
+
+    // Checkered floor
+    Material blackMat;
+    blackMat.reflectance = 0.2f;
+    blackMat.specular = glm::vec3(1.0f, 1.0f, 1.0f);
+    blackMat.albedo = glm::vec3(0.0f, 0.0f, 0.0f);
 
-    sceneObjects.push_back(std::make_shared<TiledPlane>(glm::vec3(0.0f, 0.0f, 0.0f), normalize(glm::vec3(0.0f, 1.0f, 0.0f))));
+    Material whiteMat;
+    whiteMat.reflectance = 0.3f;
+    whiteMat.specular = glm::vec3(1.0f, 1.0f, 1.0f);
+    whiteMat.albedo = glm::vec3(1.0f, 1.0f, 1.0f);
+    sceneObjects.push_back(std::make_shared<TiledPlane>(materials.Add(blackMat), materials.Add(whiteMat), glm::vec3(0.0f, 0.0f, 0.0f), normalize(glm::vec3(0.0f, 1.0f, 0.0f))));
+
+    lightTree.Build(sceneObjects, materials);
+    emitterSampler.Build(sceneObjects, materials);
 
     pCamera = std::make_shared<Camera>();
     pCamera->SetPositionAndFocalPoint(glm::vec3(0.0f, 5.0f, cameraDistance), glm::vec3(0.0f, 1.0f, 0.0f));
@@ -153,98 +277,113 @@ void InitScene()
     pManipulator = std::make_shared<Manipulator>(pCamera);
 }
 
-SceneObject* FindNearestObject(glm::vec3 rayorig, glm::vec3 raydir, float& nearestDistance)
+// Find the closest hit along the ray.  Only the hit record is filled in; surface attributes are left until
+// the caller knows it needs them
+bool FindNearestHit(const glm::vec3& rayorig, const glm::vec3& raydir, HitRecord& nearest)
 {
-    SceneObject* nearestObject = nullptr;
-    nearestDistance = std::numeric_limits<float>::max();
-
-    // find intersection of this ray with the sphere in the scene
-    for (auto pObject : sceneObjects)
+    nearest = HitRecord();
+    for (uint32_t id = 0; id < uint32_t(sceneObjects.size()); id++)
     {
-        float distance;
-        if (pObject->Intersects(rayorig, raydir, distance) &&
-            nearestDistance > distance)
+        HitRecord hit;
+        if (sceneObjects[id]->Intersects(rayorig, raydir, hit) &&
+            nearest.distance > hit.distance)
         {
-            nearestObject = pObject.get();
-            nearestDistance = distance;
+            nearest = hit;
+            nearest.primitiveId = id;
         }
     }
-    return nearestObject;
+    return nearest.primitiveId != NoPrimitive;
 }
 
-glm::vec3 TraceRay(const glm::vec3& rayorig, const glm::vec3 &raydir, const int depth)
+// The nearest hit, unless the caller already knows it
+bool FindFirstHit(const glm::vec3& rayorig, const glm::vec3& raydir, const HitRecord* pKnownHit, HitRecord& nearest)
 {
-    const SceneObject* nearestObject = nullptr;
-    float distance;
-    nearestObject = FindNearestObject(rayorig, raydir, distance);
-
-    if (!nearestObject)
+    if (pKnownHit)
     {
-        return glm::vec3{ 0.2f, 0.2f, 0.2f };
+        nearest = *pKnownHit;
+        return nearest.primitiveId != NoPrimitive;
     }
-    glm::vec3 pos = rayorig + (raydir * distance);
-    glm::vec3 normal = nearestObject->GetSurfaceNormal(pos);
-    glm::vec3 outputColor{ 0.0f, 0.0f, 0.0f };
-
-    const Material& material = nearestObject->GetMaterial(pos);
+    return FindNearestHit(rayorig, raydir, nearest);
+}
 
-    glm::vec3 reflect = glm::normalize(glm::reflect(raydir, normal));
+// Is anything other than the ignored object hit closer than maxDistance?  Returns at the first such hit.
+// The ignored object is the light being looked for, so the thread's occluder cache is checked first; rays
+// that aren't looking for a light pass NoPrimitive, and don't use the cache.
+// Callers that know only a few objects can be in reach pass them as candidates, and the rest aren't tested
+bool IsOccluded(const glm::vec3& rayorig, const glm::vec3& raydir, float maxDistance, uint32_t ignoreId, const std::vector<uint32_t>* pCandidates = nullptr)
+{
+    bool useCache = useOccluderCache && ignoreId != NoPrimitive;
+    uint32_t cachedId = NoPrimitive;
+    if (useCache)
+    {
+        cachedId = OccluderCache::ForThread().Get(ignoreId);
+        HitRecord hit;
+        if (cachedId != NoPrimitive &&
+            sceneObjects[cachedId]->Intersects(rayorig, raydir, hit) &&
+            hit.distance < maxDistance)
+        {
+            OccluderCache::ForThread().hits++;
+            return true;
+        }
+    }
 
-    // If the object is transparent, get the reflection color
-    if (depth < MAX_DEPTH && (material.reflectance > 0.0f))
+    uint32_t count = pCandidates ? uint32_t(pCandidates->size()) : uint32_t(sceneObjects.size());
+    for (uint32_t i = 0; i < count; i++)
     {
-        glm::vec3 reflectColor(0.0f, 0.0f, 0.0f);
-        glm::vec3 refractColor(0.0f, 0.0f, 0.0f);
+        uint32_t id = pCandidates ? (*pCandidates)[i] : i;
+        HitRecord hit;
+        if (id != ignoreId &&
+            id != cachedId &&
+            sceneObjects[id]->Intersects(rayorig, raydir, hit) &&
+            hit.distance < maxDistance)
+        {
+            if (useCache)
+            {
+                OccluderCache::ForThread().Set(ignoreId, id);
+                OccluderCache::ForThread().misses++;
+            }
+            return true;
+        }
+    }
 
-        reflectColor = TraceRay(pos + (reflect * 0.001f), reflect, depth + 1);
-        outputColor = (reflectColor * material.reflectance);
+    if (useCache)
+    {
+        OccluderCache::ForThread().unoccluded++;
     }
-    // For every emitter, gather the light
-    for (auto& emitterObj : sceneObjects)
+    return false;
+}
+
+// Gather the direct light from the emitters at a surface point.  With light sampling on, emissive spheres are
+// picked at random from the light tree instead of all being shaded, and weighted so the accumulated image
+// converges to the same result
+glm::vec3 GatherEmitters(const glm::vec3& pos, const glm::vec3& normal, const glm::vec3& reflect, const Material& material)
+{
+    glm::vec3 outputColor{ 0.0f, 0.0f, 0.0f };
+    auto addEmitter = [&](uint32_t emitterId, float weight)
     {
-        glm::vec3 emitterDir = emitterObj->GetRayFrom(pos);
+        const SceneObject* pEmitter = sceneObjects[emitterId].get();
+        glm::vec3 emitterDir = pEmitter->GetRayFrom(pos);
+        glm::vec3 shadowOrigin = pos + (emitterDir * 0.001f);
 
-        float bestDistance = std::numeric_limits<float>::max();
-        SceneObject* pOccluder = nullptr;
-        const Material* pEmissiveMat = nullptr;
-        for (auto& occluder : sceneObjects)
+        // Where do we reach the emitter?
+        HitRecord emitterHit;
+        if (!pEmitter->Intersects(shadowOrigin, emitterDir, emitterHit))
         {
-            if (occluder->Intersects(pos + (emitterDir * 0.001f), emitterDir, distance))
-            {
-                if (occluder == emitterObj)
-                {
-                    if (bestDistance > distance)
-                    {
-                        bestDistance = distance;
+            return;
+        }
 
-                        // If we found our emitter, and the point we hit is not emissive, then ignore
-                        pEmissiveMat = &occluder->GetMaterial(pos + (emitterDir * distance));
-                        if (pEmissiveMat->emissive == glm::vec3(0.0f, 0.0f, 0.0f))
-                        {
-                            pEmissiveMat = nullptr;
-                        }
-                        else
-                        {
-                            pOccluder = nullptr;
-                        }
-                    }
-                }
-                else
-                {
-                    if (bestDistance > distance)
-                    {
-                        pOccluder = occluder.get();
-                        pEmissiveMat = nullptr;
-                        bestDistance = distance;
-                    }
-                }
-            }
+        // Only light if the point we reached is emissive; most objects aren't, and then there's no shadow ray
+        // to cast
+        const Material& emitterMat = materials[pEmitter->GetMaterialId(emitterHit, pos + (emitterDir * emitterHit.distance))];
+        if (emitterMat.emissive == glm::vec3(0.0f, 0.0f, 0.0f))
+        {
+            return;
         }
 
-        // No emissive material, or occluder
-        if (!pEmissiveMat || pOccluder)
+        // Anything in front of it blocks the light; it doesn't matter what, or which is nearest
+        if (IsOccluded(shadowOrigin, emitterDir, emitterHit.distance, emitterId))
         {
-            continue;
+            return;
         }
 
         float diffuseI = 0.0f;
@@ -270,13 +409,307 @@ glm::vec3 TraceRay(const glm::vec3& rayorig, const glm::vec3 &raydir, const int
         {
             diffuseI = 0.0f;
         }
-        outputColor += (pEmissiveMat->emissive * material.albedo * diffuseI) + (material.specular * specI);
+        outputColor += ((emitterMat.emissive * material.albedo * diffuseI) + (material.specular * specI)) * weight;
+    };
+
+    if (lightSamples > 0 && !lightTree.Empty())
+    {
+        for (auto emitterId : lightTree.GetUnsampled())
+        {
+            addEmitter(emitterId, 1.0f);
+        }
+
+        for (int i = 0; i < lightSamples; i++)
+        {
+            LightSample sample;
+            if (lightTree.Sample(pos, normal, Sampler::ForThread().Get1D(), sample))
+            {
+                addEmitter(sample.emitterId, 1.0f / (sample.pdf * float(lightSamples)));
+            }
+        }
+    }
+    else
+    {
+        for (uint32_t emitterId = 0; emitterId < uint32_t(sceneObjects.size()); emitterId++)
+        {
+            addEmitter(emitterId, 1.0f);
+        }
+    }
+
+    return outputColor;
+}
+
+// Follow a ray and its reflections.  Rather than recursing, we walk down the path carrying the weight the rest
+// of it has in the final color, and stop when that weight is too small to matter
+glm::vec3 TraceRay(const glm::vec3& rayorig, const glm::vec3& raydir, const HitRecord* pFirstHit = nullptr)
+{
+    glm::vec3 outputColor{ 0.0f, 0.0f, 0.0f };
+    PathState path(rayorig, raydir);
+    for (;;)
+    {
+        HitRecord hit;
+        if (!FindFirstHit(path.origin, path.direction, path.depth == 0 ? pFirstHit : nullptr, hit))
+        {
+            outputColor += path.throughput * glm::vec3{ 0.2f, 0.2f, 0.2f };
+            break;
+        }
+        ShadingPoint surface(sceneObjects[hit.primitiveId].get(), hit, path.origin, path.direction);
+        const glm::vec3& pos = surface.GetPosition();
+        const glm::vec3& normal = surface.GetNormal();
+
+        const Material& material = materials[surface.GetMaterialId()];
+
+        glm::vec3 reflect = glm::normalize(glm::reflect(path.direction, normal));
+
+        // The surface keeps (1 - reflectance) of its own lighting; the reflection is scaled by both, and
+        // carried on to the next bounce
+        glm::vec3 surfaceColor = GatherEmitters(pos, normal, reflect, material) * (1.f - material.reflectance);
+        surfaceColor += material.emissive;
+        outputColor += path.throughput * surfaceColor;
+
+        if (path.depth >= MAX_DEPTH ||
+            material.reflectance <= 0.0f ||
+            !path.Extend(pos + (reflect * 0.001f), reflect, material.reflectance * (1.f - material.reflectance), pathSettings))
+        {
+            break;
+        }
+    }
+    return outputColor;
+}
+
+// Light arriving from one emitter, picked and aimed at by the emitter sampler (next event estimation).
+// Weighted against the chance of the BSDF sampling the same direction
+glm::vec3 SampleEmitter(const glm::vec3& pos, const PhongBsdf& bsdf)
+{
+    uint32_t emitterId;
+    glm::vec3 emitterDir;
+    float lightPdf;
+    auto& sampler = Sampler::ForThread();
+    float emitterSample = sampler.Get1D();
+    glm::vec2 directionSample = sampler.Get2D();
+    if (emitterSampler.Empty() || !emitterSampler.Sample(pos, emitterSample, directionSample, emitterId, emitterDir, lightPdf))
+    {
+        return glm::vec3(0.0f);
+    }
+
+    glm::vec3 f = bsdf.Evaluate(emitterDir);
+    if (f == glm::vec3(0.0f))
+    {
+        return glm::vec3(0.0f);
+    }
+
+    const SceneObject* pEmitter = sceneObjects[emitterId].get();
+    glm::vec3 shadowOrigin = pos + (emitterDir * 0.001f);
+    HitRecord emitterHit;
+    if (!pEmitter->Intersects(shadowOrigin, emitterDir, emitterHit) ||
+        IsOccluded(shadowOrigin, emitterDir, emitterHit.distance, emitterId))
+    {
+        return glm::vec3(0.0f);
+    }
+
+    const Material& emitterMat = materials[pEmitter->GetMaterialId(emitterHit, shadowOrigin + (emitterDir * emitterHit.distance))];
+    float weight = PowerHeuristic(lightPdf, bsdf.Pdf(emitterDir));
+    return emitterMat.emissive * f * (dot(bsdf.normal, emitterDir) * weight / lightPdf);
+}
+
+// Follow a path of random bounces, gathering the light from the emitters at each.  The light reaching a point
+// is estimated both by sampling an emitter and by the next bounce happening to hit one; multiple importance
+// sampling weights the two so their sum is unbiased
+glm::vec3 PathTraceRay(const glm::vec3& rayorig, const glm::vec3& raydir, const HitRecord* pFirstHit = nullptr)
+{
+    glm::vec3 outputColor{ 0.0f, 0.0f, 0.0f };
+    PathState path(rayorig, raydir);
+    float bsdfPdf = 0.0f;       // Density of the direction we arrived along; 0 from the camera or a mirror
+    for (;;)
+    {
+        HitRecord hit;
+        if (!FindFirstHit(path.origin, path.direction, path.depth == 0 ? pFirstHit : nullptr, hit))
+        {
+            outputColor += path.throughput * glm::vec3{ 0.2f, 0.2f, 0.2f };
+            break;
+        }
+        const SceneObject* pObject = sceneObjects[hit.primitiveId].get();
+        ShadingPoint surface(pObject, hit, path.origin, path.direction);
+        const glm::vec3& pos = surface.GetPosition();
+        const glm::vec3& normal = surface.GetNormal();
+
+        const Material& material = materials[surface.GetMaterialId()];
+
+        // Emitters we bounce into.  Sampling them directly could have found them too, unless we got here
+        // from the camera or a mirror
+        if (material.emissive != glm::vec3(0.0f))
+        {
+            float weight = 1.0f;
+            if (bsdfPdf > 0.0f)
+            {
+                weight = PowerHeuristic(bsdfPdf, emitterSampler.Pdf(hit.primitiveId, pObject, path.origin));
+            }
+            outputColor += path.throughput * material.emissive * weight;
+        }
+
+        glm::vec3 reflect = glm::normalize(glm::reflect(path.direction, normal));
+        PhongBsdf bsdf(material, normal, reflect);
+        outputColor += path.throughput * SampleEmitter(pos, bsdf);
+
+        if (path.depth >= PATH_DEPTH)
+        {
+            break;
+        }
+
+        glm::vec3 bounceDir;
+        bool mirror;
+        float lobeSample = Sampler::ForThread().Get1D();
+        glm::vec3 weight = bsdf.Sample(lobeSample, Sampler::ForThread().Get2D(), bounceDir, bsdfPdf, mirror);
+        if (weight == glm::vec3(0.0f))
+        {
+            break;
+        }
+        path.throughput *= weight;
+        if (!path.Extend(pos + (bounceDir * 0.001f), bounceDir, 1.0f, pathSettings))
+        {
+            break;
+        }
     }
-    outputColor *= 1.f - material.reflectance;
-    outputColor += material.emissive;
     return outputColor;
 }
 
+// The fraction of the hemisphere above the first hit that is open, cosine weighted, out to
+// ambientOcclusionDistance.  There are no lights and no reflections, only the primary ray and a few short
+// any-hit rays, so it is a fast preview of the shapes in a scene
+glm::vec3 AmbientOcclusionRay(const glm::vec3& rayorig, const glm::vec3& raydir, const HitRecord* pFirstHit = nullptr)
+{
+    HitRecord hit;
+    if (!FindFirstHit(rayorig, raydir, pFirstHit, hit))
+    {
+        return glm::vec3{ 0.2f, 0.2f, 0.2f };
+    }
+    ShadingPoint surface(sceneObjects[hit.primitiveId].get(), hit, rayorig, raydir);
+    const glm::vec3& pos = surface.GetPosition();
+    const glm::vec3& normal = surface.GetNormal();
+
+    // Only objects that come within reach of the point can shut it in; with none, it is open without casting
+    // anything
+    thread_local std::vector<uint32_t> nearby;
+    nearby.clear();
+    for (uint32_t id = 0; id < uint32_t(sceneObjects.size()); id++)
+    {
+        if (sceneObjects[id]->MayBeWithin(pos, ambientOcclusionDistance))
+        {
+            nearby.push_back(id);
+        }
+    }
+    if (nearby.empty())
+    {
+        return glm::vec3(1.0f);
+    }
+
+    // One ray per stratum of cos^2(theta), each turned a golden ratio of a circle from the last, and the whole
+    // set shifted by one sample point, so even a few rays cover the hemisphere evenly
+    glm::vec2 shift = Sampler::ForThread().Get2D();
+    int open = 0;
+    for (int i = 0; i < ambientOcclusionSamples; i++)
+    {
+        float u = (float(i) + shift.x) / float(ambientOcclusionSamples);
+        float turn = float(i) * 0.618034f + shift.y;
+        glm::vec3 dir = DirectionAround(normal, std::sqrt(1.0f - u), 2.0f * Pi * (turn - std::floor(turn)));
+        if (!IsOccluded(pos + (dir * 0.001f), dir, ambientOcclusionDistance, NoPrimitive, &nearby))
+        {
+            open++;
+        }
+    }
+    return glm::vec3(float(open) / float(ambientOcclusionSamples));
+}
+
+// Distance at which the depth view has faded to a third
+const float DepthFalloff = 10.0f;
+
+// Microseconds per camera ray that show as the top of the traversal cost heat map
+const float CostScale = 4.0f;
+
+// The render modes
+struct WhittedIntegrator : Integrator
+{
+    glm::vec3 Trace(const glm::vec3& rayorig, const glm::vec3& raydir, const HitRecord* pFirstHit) const override
+    {
+        return TraceRay(rayorig, raydir, pFirstHit);
+    }
+};
+
+struct AmbientOcclusionIntegrator : Integrator
+{
+    glm::vec3 Trace(const glm::vec3& rayorig, const glm::vec3& raydir, const HitRecord* pFirstHit) const override
+    {
+        return AmbientOcclusionRay(rayorig, raydir, pFirstHit);
+    }
+};
+
+struct PathIntegrator : Integrator
+{
+    glm::vec3 Trace(const glm::vec3& rayorig, const glm::vec3& raydir, const HitRecord* pFirstHit) const override
+    {
+        return PathTraceRay(rayorig, raydir, pFirstHit);
+    }
+};
+
+struct NormalsIntegrator : Integrator
+{
+    glm::vec3 Trace(const glm::vec3& rayorig, const glm::vec3& raydir, const HitRecord* pFirstHit) const override
+    {
+        HitRecord hit;
+        if (!FindFirstHit(rayorig, raydir, pFirstHit, hit))
+        {
+            return glm::vec3(0.0f);
+        }
+        ShadingPoint surface(sceneObjects[hit.primitiveId].get(), hit, rayorig, raydir);
+        return surface.GetNormal() * 0.5f + glm::vec3(0.5f);
+    }
+};
+
+struct DepthIntegrator : Integrator
+{
+    glm::vec3 Trace(const glm::vec3& rayorig, const glm::vec3& raydir, const HitRecord* pFirstHit) const override
+    {
+        HitRecord hit;
+        if (!FindFirstHit(rayorig, raydir, pFirstHit, hit))
+        {
+            return glm::vec3(0.0f);
+        }
+        return glm::vec3(std::exp(-hit.distance / DepthFalloff));
+    }
+};
+
+// The whole of the Whitted trace is timed, so long reflection paths and shadow rays all show up.  That includes
+// the camera ray, so a cached hit isn't used
+struct TraversalCostIntegrator : Integrator
+{
+    glm::vec3 Trace(const glm::vec3& rayorig, const glm::vec3& raydir, const HitRecord*) const override
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        TraceRay(rayorig, raydir);
+        auto end = std::chrono::high_resolution_clock::now();
+        return HeatMap(float(std::chrono::duration<double, std::micro>(end - start).count()) / CostScale);
+    }
+};
+
+std::unique_ptr<Integrator> CreateIntegrator(IntegratorType type)
+{
+    switch (type)
+    {
+    case IntegratorType::AmbientOcclusion:
+        return std::make_unique<AmbientOcclusionIntegrator>();
+    case IntegratorType::PathTrace:
+        return std::make_unique<PathIntegrator>();
+    case IntegratorType::Normals:
+        return std::make_unique<NormalsIntegrator>();
+    case IntegratorType::Depth:
+        return std::make_unique<DepthIntegrator>();
+    case IntegratorType::TraversalCost:
+        return std::make_unique<TraversalCostIntegrator>();
+    default:
+        return std::make_unique<WhittedIntegrator>();
+    }
+}
+
 void DrawScene(int partitions, bool antialias)
 {
     if (!spBitmap)
@@ -284,37 +717,142 @@ void DrawScene(int partitions, bool antialias)
         return;
     }
 
-    auto t = time(NULL);
-    std::srand((unsigned int)t);
+    // Starting over; after a camera move, from what the last view had seen
+    if (currentSample == 0)
+    {
+        if (reprojectOnMove)
+        {
+            reprojection.Capture(buffer);
+        }
+        buffer.Reset();
+        convergence.Reset();
+        resolution.Start();
+        hitCache.Clear();
+    }
+
+    // Camera rays only repeat exactly without depth of field
+    bool useHitCache = hitCache.Enabled() && pCamera->GetLensRadius() == 0.0f;
+    bool fullResolution = resolution.FullResolution();
+    auto start = std::chrono::high_resolution_clock::now();
 
+    // Threads take the tiles that still need samples in turn.  Converged pixels stop taking them, so each
+    // pixel keeps its own count
     std::vector<std::shared_ptr<std::thread>> threads;
-
-    const float k1 = float(currentSample);
-    const float k2 = 1.f / (k1 + 1.f);
-    glm::vec2 sample = glm::linearRand(glm::vec2(0.0f), glm::vec2(1.0f));
-    //glm::vec2 sample = glm::gaussRand(glm::vec2(0.5f), glm::vec2(0.5f));
+    std::atomic<int> nextTile{ 0 };
     for (int i = 0; i < partitions; i++)
     {
-        auto pT = std::make_shared<std::thread>([&](int offset)
+        auto pT = std::make_shared<std::thread>([&]()
         {
-            for (int y = offset; y < ImageHeight; y += partitions)
+            auto& sampler = Sampler::ForThread();
+            for (int tile = nextTile++; tile < convergence.TileCount(); tile = nextTile++)
             {
-                for (int x = 0; x < ImageWidth; x += 1)
+                if (convergence.IsConverged(tile))
                 {
-                    srand(time(0));
-                    glm::vec3 color{ 0.0f, 0.0f, 0.0f };
-                    auto offset = /*sample + */glm::vec2(x, y);
+                    continue;
+                }
 
-                    auto ray = pCamera->GetWorldRay(offset);
-                    color += TraceRay(ray.position, ray.direction, 0);
+                int x0, y0, x1, y1;
+                convergence.TileBounds(tile, x0, y0, x1, y1);
+                if (!renderRegion.Empty() && !renderRegion.Overlaps(x0, y0, x1, y1))
+                {
+                    continue;
+                }
 
-                    auto index = (y * ImageWidth) + x;
-                    auto& bufferVal = buffer[index];
+                float maxError = 0.0f;
+                for (int y = y0; y < y1; y++)
+                {
+                    for (int x = x0; x < x1; x++)
+                    {
+                        auto index = (y * ImageWidth) + x;
+                        // Pixels outside the region keep the tile open, so it still has work once the region
+                        // grows or is cleared
+                        if (!InRenderRegion(x, y))
+                        {
+                            maxError = std::numeric_limits<float>::max();
+                            continue;
+                        }
+                        if (convergence.IsPixelConverged(index))
+                        {
+                            continue;
+                        }
+
+                        // Foveation thins out the full resolution passes; the coarse ones need every pixel they trace
+                        if (!resolution.ShouldTrace(x, y) ||
+                            (fullResolution && !foveation.ShouldSample(x, y, uint32_t(index), uint32_t(currentSample))))
+                        {
+                            maxError = std::max(maxError, convergence.RelativeError(index));
+                            continue;
+                        }
+
+                        // A pixel's first sample in a view records what it sees, to match it up with the next view,
+                        // and starts it from what the last view saw there
+                        if (reprojectOnMove && convergence.SampleCount(index) == 0)
+                        {
+                            Ray pinhole = pCamera->GetWorldRay(glm::vec2(float(x), float(y)), glm::vec2(0.5f));
+                            HitRecord hit;
+                            PrimaryHit primary;
+                            if (FindNearestHit(pinhole.position, pinhole.direction, hit))
+                            {
+                                primary.primitiveId = hit.primitiveId;
+                                primary.distance = hit.distance;
+                            }
+                            reprojection.SetHit(index, primary);
+
+                            glm::vec3 history;
+                            uint32_t historyCount;
+                            if (reprojection.Find(pinhole, primary, history, historyCount))
+                            {
+                                buffer.Seed(index, history, historyCount);
+                            }
+                        }
 
-                    bufferVal = ((bufferVal * k1) + glm::vec4(color, 1.0f)) * k2;
+                        glm::vec3 color{ 0.0f, 0.0f, 0.0f };
+
+                        // Numbered by the pixel's own samples, since coarse and converged passes skip pixels.  The
+                        // first points drawn place it in the pixel (when antialiasing) and on the lens; the
+                        // integrator draws the rest
+                        uint32_t sampleIndex = convergence.SampleCount(index);
+                        sampler.Start(samplerType, uint32_t(index), sampleIndex);
+                        glm::vec2 pixelSample = sampler.Get2D();
+                        glm::vec2 lensSample = sampler.Get2D();
+
+                        // With the hit cache, the pixel positions cycle through those of the first few samples
+                        const HitRecord* pFirstHit = nullptr;
+                        if (useHitCache)
+                        {
+                            uint32_t cachePosition = antialias ? hitCache.Position(sampleIndex) : 0;
+                            auto& cached = hitCache.Get(index, cachePosition, [&](CachedHit& entry) {
+                                if (antialias)
+                                {
+                                    sampler.Start(samplerType, uint32_t(index), cachePosition);
+                                    entry.pixelSample = sampler.Get2D();
+                                    sampler.Start(samplerType, uint32_t(index), sampleIndex);
+                                    sampler.Get2D();
+                                    sampler.Get2D();
+                                }
+                                Ray firstRay = pCamera->GetWorldRay(glm::vec2(float(x), float(y)) + entry.pixelSample, lensSample);
+                                FindNearestHit(firstRay.position, firstRay.direction, entry.hit);
+                            });
+                            pixelSample = cached.pixelSample;
+                            pFirstHit = &cached.hit;
+                        }
+
+                        Ray ray = pCamera->GetWorldRay(glm::vec2(float(x), float(y)) + (antialias ? pixelSample : glm::vec2(0.0f)), lensSample);
+                        color += pIntegrator->Trace(ray.position, ray.direction, pFirstHit);
+
+                        buffer.Add(index, color);
+                        convergence.AddSample(index, Luminance(color));
+
+                        maxError = std::max(maxError, convergence.RelativeError(index));
+                    }
+                }
+                // Tiles only converge once every pixel in them is being sampled
+                if (fullResolution)
+                {
+                    convergence.UpdateTile(tile, maxError);
                 }
             }
-        }, i);
+        });
         threads.push_back(pT);
     }
 
@@ -322,6 +860,8 @@ void DrawScene(int partitions, bool antialias)
     {
         t->join();
     }
+    reprojection.FinishPass(*pCamera);
+    resolution.FinishPass(float(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count()));
     currentSample++;
     CopyTargetToBitmap();
     InvalidateRect(hWnd, NULL, TRUE);
@@ -341,6 +881,7 @@ void OnSizeChanged()
     InitMaps();
 
     pCamera->SetFilmSize(float(ImageWidth), float(ImageHeight));
+    UpdateFocus();
 
     currentSample = 0;
 }
@@ -357,6 +898,7 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message,
     {
         if (wParam == 'o')
         {
+            reprojection.Invalidate();
             currentSample = 0;
         }
         else if (wParam == 'p')
@@ -404,7 +946,12 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message,
     {
         auto xPos = GET_X_LPARAM(lParam);
         auto yPos = GET_Y_LPARAM(lParam);
-        if (pManipulator->MouseMove(glm::vec2(xPos, yPos)))
+        if (draggingRegion)
+        {
+            regionDragEnd = glm::ivec2(xPos, yPos);
+            InvalidateRect(hWnd, NULL, TRUE);
+        }
+        else if (pManipulator->MouseMove(glm::vec2(xPos, yPos)))
         {
             currentSample = 0;
             step = true;
@@ -430,6 +977,36 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message,
     }
     break;
 
+    // Drag out a render region with the right button; a click clears it
+    case WM_RBUTTONDOWN:
+    {
+        regionDragStart = glm::ivec2(GET_X_LPARAM(lParam), GET_Y_LPARAM(lParam));
+        regionDragEnd = regionDragStart;
+        draggingRegion = true;
+        SetCapture(hWnd);
+    }
+    break;
+
+    case WM_RBUTTONUP:
+    {
+        regionDragEnd = glm::ivec2(GET_X_LPARAM(lParam), GET_Y_LPARAM(lParam));
+        renderRegion = RegionFromDrag(regionDragStart, regionDragEnd);
+        draggingRegion = false;
+        ReleaseCapture();
+        UpdateFocus();
+        step = true;
+    }
+    break;
+
+    // The middle button moves the foveation focus
+    case WM_MBUTTONDOWN:
+    {
+        glm::vec2 picked(float(GET_X_LPARAM(lParam)), float(GET_Y_LPARAM(lParam)));
+        UpdateFocus(&picked);
+        step = true;
+    }
+    break;
+
     case WM_SIZE:
     {
         spBitmap.reset();
@@ -511,10 +1088,50 @@ INT WINAPI WinMain(HINSTANCE hInstance, HINSTANCE, PSTR, INT iCmdShow)
     cli::Parser parser(__argc, __argv);
     parser.set_optional<int>("p", "partitions", 2, "thread partitions 2 == 4, 3 == 9");
     parser.set_optional<int>("a", "antialiased", 0, "Antialias each pixel");
+    parser.set_optional<int>("l", "lightsamples", 0, "Lights to sample from the light tree at each hit, or 0 to shade every light");
+    parser.set_optional<int>("c", "occludercache", 1, "Test the last object to shadow each light first");
+    parser.set_optional<float>("t", "throughput", 1.0f / 512.0f, "Stop following reflections once their weight is below this");
+    parser.set_optional<int>("r", "roulette", 1, "Russian roulette on weak reflections instead of stopping them");
+    parser.set_optional<std::string>("i", "integrator", "whitted", "Render mode: " + IntegratorNameList());
+    parser.set_optional<std::string>("q", "sampler", "sobol", "Sample points: sobol or random");
+    parser.set_optional<int>("o", "aosamples", 4, "Rays cast from each hit in the ao mode");
+    parser.set_optional<float>("h", "aodistance", 1.5f, "How far the ao rays look for occluders");
+    parser.set_optional<float>("e", "errorthreshold", 0.01f, "Stop sampling tiles once their pixels' relative error is below this, or 0 to sample every pixel each pass");
+    parser.set_optional<int>("m", "minsamples", 16, "Samples every pixel takes before its tile can stop");
+    parser.set_optional<int>("j", "reproject", 1, "Carry the image over to the new view when the camera moves");
+    parser.set_optional<float>("z", "frametime", 50.0f, "Target time in ms for the first pass after the camera moves; it starts at up to 1/8 resolution to meet it, or 0 for full resolution");
+    parser.set_optional<int>("x", "checkerboard", 0, "Trace alternate pixels each pass, filling in the others");
+    parser.set_optional<std::string>("g", "region", "", "Only render the pixels in x0,y0,x1,y1; drag with the right button to change it");
+    parser.set_optional<float>("v", "foveate", 0.0f, "Sample pixels within this many pixels of the focus every pass, and fewer further out, or 0 for all");
+    parser.set_optional<float>("f", "aperture", 0.14f, "Lens radius for depth of field, or 0 for a pinhole");
+    parser.set_optional<int>("y", "hitcache", 4, "Sub pixel positions to cache camera ray hits for while the camera is still, without depth of field; 0 for none");
+    parser.set_optional<std::string>("u", "accumulation", "double", "Sample sums: float, double, or compensated for float with Kahan summation");
     parser.run();
 
     auto partitions = parser.get<int>("p");
     auto antialias = parser.get<int>("a") == 0 ? false : true;
+    lightSamples = parser.get<int>("l");
+    useOccluderCache = parser.get<int>("c") == 0 ? false : true;
+    pathSettings.throughputCutoff = parser.get<float>("t");
+    pathSettings.russianRoulette = parser.get<int>("r") == 0 ? false : true;
+    ambientOcclusionSamples = std::max(1, parser.get<int>("o"));
+    ambientOcclusionDistance = parser.get<float>("h");
+    reprojectOnMove = parser.get<int>("j") == 0 ? false : true;
+    resolution.SetTargetFrameTime(parser.get<float>("z"));
+    pCamera->SetLensRadius(std::max(0.0f, parser.get<float>("f")));
+    hitCachePositions = std::max(0, parser.get<int>("y"));
+    ParseRegion(parser.get<std::string>("g"), renderRegion);
+    foveationRadius = std::max(0.0f, parser.get<float>("v"));
+    resolution.SetCheckerboard(parser.get<int>("x") == 0 ? false : true);
+    FindAccumulation(parser.get<std::string>("u"), accumulationType);
+    convergence.SetThreshold(parser.get<float>("e"), uint32_t(std::max(0, parser.get<int>("m"))));
+
+    samplerType = parser.get<std::string>("q") == "random" ? SamplerType::Random : SamplerType::Sobol;
+
+    // There's no console to report a bad name to; it just leaves the Whitted default
+    IntegratorType integratorType = IntegratorType::Whitted;
+    FindIntegrator(parser.get<std::string>("i"), integratorType);
+    pIntegrator = CreateIntegrator(integratorType);
 
     Color col{ 127, 127, 127 };
 
@@ -549,7 +1166,16 @@ INT WINAPI WinMain(HINSTANCE hInstance, HINSTANCE, PSTR, INT iCmdShow)
                     DrawScene(partitions, antialias);
                 }
             }
-            SetWindowTextA(hWnd, std::to_string(currentSample).c_str());
+            std::string title = std::to_string(currentSample);
+            if (convergence.ActiveTiles() < convergence.TileCount())
+            {
+                title += " - " + std::to_string(convergence.ActiveTiles()) + "/" + std::to_string(convergence.TileCount()) + " tiles sampling";
+            }
+            if (useOccluderCache)
+            {
+                title += " - occluder cache " + std::to_string(int(GetOccluderCacheStats().HitRate() * 100.0)) + "%";
+            }
+            SetWindowTextA(hWnd, title.c_str());
             step = false;
         }
     }
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <random>
+
+// When to stop following a path.
+// Each bounce scales what the rest of the path can add to the pixel; once that weight is small enough, the
+// remaining bounces can't change the 8 bit output, so we stop paying for them.
+struct PathSettings
+{
+    float throughputCutoff = 1.0f / 512.0f;     // Paths whose weight falls below this in every channel end
+    bool russianRoulette = false;               // Continue weak paths at random instead, reweighting survivors
+};
+
+// Uniform random number in [0, 1), with a generator per thread
+inline float RandomFloat()
+{
+    thread_local std::mt19937 generator(std::random_device{}());
+    thread_local std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+    return distribution(generator);
+}
+
+// A path being traced iteratively: the next ray, and how much whatever it finds adds to the pixel
+struct PathState
+{
+    glm::vec3 origin;
+    glm::vec3 direction;
+    glm::vec3 throughput = glm::vec3(1.0f);
+    int depth = 0;
+
+    PathState(const glm::vec3& rayorig, const glm::vec3& raydir)
+        : origin(rayorig),
+        direction(raydir)
+    {
+    }
+
+    // Move on to the next ray, scaling the path weight.  Returns false if the path should end here
+    bool Extend(const glm::vec3& rayorig, const glm::vec3& raydir, float weight, const PathSettings& settings)
+    {
+        throughput *= weight;
+        origin = rayorig;
+        direction = raydir;
+        depth++;
+
+        float strength = std::max(throughput.x, std::max(throughput.y, throughput.z));
+        if (strength >= settings.throughputCutoff)
+        {
+            return true;
+        }
+
+        if (!settings.russianRoulette || strength <= 0.0f)
+        {
+            return false;
+        }
+
+        // Survive with a chance proportional to the weight, and boost the survivors so the average is unchanged
+        float survival = strength / settings.throughputCutoff;
+        if (RandomFloat() >= survival)
+        {
+            return false;
+        }
+        throughput /= survival;
+        return true;
+    }
+};
@@ -0,0 +1,105 @@
+#pragma once
+
+// Progressive resolution.
+// The first pass of a new view traces one pixel in each block of up to 8x8, and every pass after that halves
+// the block, tracing only the pixels the coarser passes left out, until each pixel has a sample and passes run
+// at full resolution.  No work is thrown away: each traced pixel keeps its sample.  Pixels still waiting for
+// one are shown with the color of their block's corner, which is traced first.
+// The starting block adapts to how long the first passes take, so moving the camera stays near a target frame
+// time however big the window or slow the scene.
+// In checkerboard mode, full resolution passes trace alternate pixels, swapping over every pass, so each pass
+// costs half as much.  A skipped pixel shows what it accumulated before; until it has anything, it is filled in
+// from the neighbours that were traced.
+
+class ProgressiveResolution
+{
+public:
+    static const int MaxBlock = 8;
+
+    void SetTargetFrameTime(float milliseconds)
+    {
+        targetFrameTime = milliseconds;
+    }
+
+    void SetCheckerboard(bool enable)
+    {
+        checkerboard = enable;
+    }
+
+    // A new view; the block size starts where it left off
+    void Start()
+    {
+        block = targetFrameTime > 0.0f ? startBlock : 1;
+        previousBlock = 0;
+    }
+
+    // Called after each pass, with its time.  The first pass of a view tunes the starting block for the next
+    void FinishPass(float milliseconds)
+    {
+        if (previousBlock == 0 && targetFrameTime > 0.0f)
+        {
+            if (milliseconds > targetFrameTime && startBlock < MaxBlock)
+            {
+                startBlock *= 2;
+            }
+            else if (milliseconds < targetFrameTime * 0.25f && startBlock > 1)
+            {
+                startBlock /= 2;
+            }
+        }
+
+        previousBlock = block;
+        block = std::max(1, block / 2);
+        parity ^= 1;
+    }
+
+    // Is the pixel traced this pass?  At full resolution, all of them are, or half in checkerboard mode
+    bool ShouldTrace(int x, int y) const
+    {
+        if (FullResolution())
+        {
+            return !checkerboard || ((x + y + parity) & 1) == 0;
+        }
+
+        if (!OnGrid(x, y, block))
+        {
+            return false;
+        }
+        return previousBlock <= 1 || !OnGrid(x, y, previousBlock);
+    }
+
+    // Is every pixel being sampled, in this pass or (checkerboard) alternate ones?
+    bool FullResolution() const
+    {
+        return block == 1 && previousBlock <= 1;
+    }
+
+    // The pixel to show in place of one that has no samples yet: its corner in the smallest block that has
+    // been traced
+    template <typename HasSamples>
+    static int StandIn(int x, int y, int imageWidth, const HasSamples& hasSamples)
+    {
+        for (int size = 2; size <= MaxBlock; size *= 2)
+        {
+            int index = ((y / size) * size * imageWidth) + ((x / size) * size);
+            if (hasSamples(index))
+            {
+                return index;
+            }
+        }
+        return (y * imageWidth) + x;
+    }
+
+private:
+    static bool OnGrid(int x, int y, int size)
+    {
+        return (x % size) == 0 && (y % size) == 0;
+    }
+
+    float targetFrameTime = 0.0f;
+    int startBlock = 1;
+    int block = 1;
+    int previousBlock = 0;      // 0 for the first pass of a view
+    bool checkerboard = false;
+    int parity = 0;             // Which half of the checkerboard is traced
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <string>
+#include <cstdio>
+
+// Render regions and foveation.
+// A region limits tracing to a rectangle of the image, so working on one object doesn't pay for the whole
+// frame; pixels outside it are left alone.  Foveation spreads the samples of each pass unevenly: pixels near
+// the focus are sampled every pass, and further out only a share of passes, falling with the square of the
+// distance.  Every pixel still averages its own samples, so the image stays correct, only noisier away from
+// the focus.
+
+// [x0, x1) by [y0, y1), in pixels
+struct PixelRect
+{
+    int x0 = 0;
+    int y0 = 0;
+    int x1 = 0;
+    int y1 = 0;
+
+    bool Empty() const
+    {
+        return x1 <= x0 || y1 <= y0;
+    }
+
+    bool Contains(int x, int y) const
+    {
+        return x >= x0 && y >= y0 && x < x1 && y < y1;
+    }
+
+    bool Overlaps(int left, int top, int right, int bottom) const
+    {
+        return left < x1 && right > x0 && top < y1 && bottom > y0;
+    }
+};
+
+// A rectangle written as "x0,y0,x1,y1".  Fails if it isn't one
+inline bool ParseRegion(const std::string& text, PixelRect& rect)
+{
+    PixelRect parsed;
+    if (std::sscanf(text.c_str(), "%d,%d,%d,%d", &parsed.x0, &parsed.y0, &parsed.x1, &parsed.y1) != 4 || parsed.Empty())
+    {
+        return false;
+    }
+    rect = parsed;
+    return true;
+}
+
+class Foveation
+{
+public:
+    // Outside the radius, the share of passes falls off to this at the least
+    static constexpr float MinRate = 1.0f / 16.0f;
+
+    // A radius of 0 samples every pixel every pass
+    void Set(const glm::vec2& focusPoint, float focusRadius)
+    {
+        focus = focusPoint;
+        radius = focusRadius;
+    }
+
+    bool Enabled() const
+    {
+        return radius > 0.0f;
+    }
+
+    const glm::vec2& Focus() const
+    {
+        return focus;
+    }
+
+    // The share of passes that sample a pixel
+    float Rate(int x, int y) const
+    {
+        if (radius <= 0.0f)
+        {
+            return 1.0f;
+        }
+        float distanceSq = glm::dot(glm::vec2(float(x), float(y)) - focus, glm::vec2(float(x), float(y)) - focus);
+        return distanceSq <= radius * radius ? 1.0f : std::max(MinRate, (radius * radius) / distanceSq);
+    }
+
+    // Does the pixel take a sample this pass?  Decided by a hash of the pixel and pass, so neighbours don't
+    // all skip the same passes
+    bool ShouldSample(int x, int y, uint32_t index, uint32_t pass) const
+    {
+        float rate = Rate(x, y);
+        if (rate >= 1.0f)
+        {
+            return true;
+        }
+        uint32_t h = (index * 0x9e3779b1u) ^ (pass * 0x85ebca6bu);
+        h ^= h >> 16;
+        h *= 0x7feb352du;
+        h ^= h >> 15;
+        h *= 0x846ca68bu;
+        h ^= h >> 16;
+        return float(h >> 8) * (1.0f / 16777216.0f) < rate;
+    }
+
+private:
+    glm::vec2 focus = glm::vec2(0.0f);
+    float radius = 0.0f;
+};
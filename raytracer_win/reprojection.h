@@ -0,0 +1,136 @@
+#pragma once
+
+// Temporal reprojection.
+// When the camera moves, the image accumulated so far is not thrown away.  When a pixel of the new view takes
+// its first sample, it finds the point its pinhole ray hits, projects it into the previous view, and takes that
+// pixel's color as a head start, if the previous view saw the same object at the same distance there.  Pixels
+// that were hidden or off screen start from nothing.  Only traced pixels pay for the pinhole ray, so the coarse
+// passes after a move stay cheap; the pixels they skip pick up their history when they are first traced.
+// The history is worth a few samples at most, so new samples soon replace it, and shading that changes with the
+// view (reflections, highlights) only trails a little behind.
+
+// What a pixel's pinhole ray hit, for matching pixels between views
+struct PrimaryHit
+{
+    uint32_t primitiveId = NoPrimitive;
+    float distance = 0.0f;
+};
+
+class Reprojection
+{
+public:
+    // Samples the reprojected color counts as, at most
+    static const uint32_t MaxHistory = 8;
+
+    // Distances that differ by more than this, relative to the distance, are a different surface
+    static constexpr float DepthTolerance = 0.05f;
+
+    void Resize(int imageWidth, int imageHeight)
+    {
+        width = imageWidth;
+        height = imageHeight;
+        currentHits.assign(size_t(width) * size_t(height), PrimaryHit());
+        Invalidate();
+    }
+
+    // Nothing to carry over to the next view
+    void Invalidate()
+    {
+        hasView = false;
+    }
+
+    // Recorded for a pixel when it is first traced in a view
+    void SetHit(int index, const PrimaryHit& hit)
+    {
+        currentHits[index] = hit;
+    }
+
+    // Called after every pass, with the camera it was drawn from
+    void FinishPass(const Camera& camera)
+    {
+        lastCamera = camera;
+        hasView = true;
+    }
+
+    // Keep the current view's image for reprojecting into the next one, if there is one.  Pixels it never
+    // traced have no samples, so their stale hits are never matched
+    void Capture(const AccumulationBuffer& buffer)
+    {
+        hasHistory = hasView;
+        if (!hasView)
+        {
+            return;
+        }
+
+        previousCamera = lastCamera;
+        previousHits.swap(currentHits);
+        currentHits.resize(previousHits.size());
+        previousColors.resize(previousHits.size());
+        previousCounts.resize(previousHits.size());
+        for (size_t index = 0; index < previousHits.size(); index++)
+        {
+            previousColors[index] = buffer.Mean(int(index));
+            previousCounts[index] = std::min(buffer.Count(int(index)), MaxHistory);
+        }
+        hasView = false;
+    }
+
+    // The previous view's color for the point a new pixel's pinhole ray hit, and how many samples it is worth.
+    // Fails if the previous view didn't see the same surface there
+    bool Find(const Ray& pinhole, const PrimaryHit& hit, glm::vec3& color, uint32_t& count) const
+    {
+        if (!hasHistory)
+        {
+            return false;
+        }
+
+        // The background is infinitely far away, so only the direction matters
+        glm::vec3 point = hit.primitiveId == NoPrimitive ?
+            previousCamera.GetPosition() + pinhole.direction :
+            pinhole.position + pinhole.direction * hit.distance;
+
+        glm::vec2 raster;
+        if (!previousCamera.WorldToRaster(point, raster))
+        {
+            return false;
+        }
+
+        int x = int(std::floor(raster.x + 0.5f));
+        int y = int(std::floor(raster.y + 0.5f));
+        if (x < 0 || y < 0 || x >= width || y >= height)
+        {
+            return false;
+        }
+
+        int index = (y * width) + x;
+        const PrimaryHit& previous = previousHits[index];
+        if (previous.primitiveId != hit.primitiveId || previousCounts[index] == 0)
+        {
+            return false;
+        }
+        if (hit.primitiveId != NoPrimitive)
+        {
+            float distance = glm::length(point - previousCamera.GetPosition());
+            if (std::abs(previous.distance - distance) > DepthTolerance * distance)
+            {
+                return false;
+            }
+        }
+
+        color = previousColors[index];
+        count = previousCounts[index];
+        return true;
+    }
+
+private:
+    int width = 0;
+    int height = 0;
+    bool hasView = false;
+    bool hasHistory = false;    // A previous view was captured
+    Camera lastCamera;
+    Camera previousCamera;
+    std::vector<PrimaryHit> currentHits;
+    std::vector<PrimaryHit> previousHits;
+    std::vector<glm::vec3> previousColors;
+    std::vector<uint32_t> previousCounts;
+};
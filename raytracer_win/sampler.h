@@ -0,0 +1,127 @@
+#pragma once
+
+// Sample points for everything a pixel sample decides at random: where in the pixel it goes, where on the lens
+// it starts, which light it picks and which way it bounces.
+// With the Sobol sampler these are Owen-scrambled Sobol points, made per pixel and per dimension by hashing
+// (Burley, 'Practical Hash-based Owen Scrambling', 2020).  The first n samples of a pixel are then spread
+// evenly in each dimension, and across each pair of dimensions drawn together, so error falls faster with the
+// sample count than with independent random numbers.  Each pixel is scrambled differently, so the pattern
+// doesn't repeat across the image.
+// Callers draw dimensions in order after Start; a sample that draws the same things in the same order as
+// another gets the same dimensions, so paths stay stratified against each other bounce by bounce.
+
+enum class SamplerType
+{
+    Random,     // Independent uniform numbers
+    Sobol       // Owen-scrambled Sobol points
+};
+
+class Sampler
+{
+public:
+    // The calling thread's sampler
+    static Sampler& ForThread()
+    {
+        thread_local Sampler sampler;
+        return sampler;
+    }
+
+    // Begin a pixel's sampleIndex'th sample; dimensions count from 0 again
+    void Start(SamplerType samplerType, uint32_t pixel, uint32_t sampleIndex)
+    {
+        type = samplerType;
+        seed = Hash(pixel);
+        index = sampleIndex;
+        dimension = 0;
+    }
+
+    float Get1D()
+    {
+        if (type == SamplerType::Random)
+        {
+            return RandomFloat();
+        }
+
+        uint32_t dimensionSeed = Hash(seed ^ Hash(dimension++));
+        return ToFloat(Scramble(ReverseBits(ShuffledIndex(dimensionSeed)), Hash(dimensionSeed)));
+    }
+
+    // Two dimensions that are stratified against each other, as well as on their own
+    glm::vec2 Get2D()
+    {
+        if (type == SamplerType::Random)
+        {
+            float x = RandomFloat();
+            return glm::vec2(x, RandomFloat());
+        }
+
+        uint32_t dimensionSeed = Hash(seed ^ Hash(dimension++));
+        uint32_t shuffled = ShuffledIndex(dimensionSeed);
+        return glm::vec2(ToFloat(Scramble(ReverseBits(shuffled), Hash(dimensionSeed ^ 0x5bd1e995u))),
+            ToFloat(Scramble(SobolSecondDimension(shuffled), Hash(dimensionSeed ^ 0x68e31da4u))));
+    }
+
+private:
+    // Samples are taken in a different order in each dimension, so dimensions don't correlate
+    uint32_t ShuffledIndex(uint32_t dimensionSeed) const
+    {
+        return Scramble(index, dimensionSeed);
+    }
+
+    // The second Sobol dimension; the first is the index with its bits reversed
+    static uint32_t SobolSecondDimension(uint32_t i)
+    {
+        uint32_t result = 0;
+        for (uint32_t v = 1u << 31; i != 0; i >>= 1, v ^= v >> 1)
+        {
+            if (i & 1)
+            {
+                result ^= v;
+            }
+        }
+        return result;
+    }
+
+    // Nested uniform (Owen) scrambling: every bit is flipped depending on the bits above it.  Done as a hash
+    // that only carries upwards, applied to the reversed bits (Laine and Karras)
+    static uint32_t Scramble(uint32_t x, uint32_t scrambleSeed)
+    {
+        x = ReverseBits(x);
+        x += scrambleSeed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return ReverseBits(x);
+    }
+
+    static uint32_t ReverseBits(uint32_t x)
+    {
+        x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+        x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+        x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+        x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    static uint32_t Hash(uint32_t x)
+    {
+        x ^= x >> 16;
+        x *= 0x7feb352du;
+        x ^= x >> 15;
+        x *= 0x846ca68bu;
+        x ^= x >> 16;
+        return x;
+    }
+
+    // The top 24 bits, as a float in [0, 1)
+    static float ToFloat(uint32_t x)
+    {
+        return float(x >> 8) * (1.0f / 16777216.0f);
+    }
+
+    SamplerType type = SamplerType::Random;
+    uint32_t seed = 0;
+    uint32_t index = 0;
+    uint32_t dimension = 0;
+};
@@ -3,10 +3,51 @@
 #include "glm/glm/gtx/intersect.hpp"
 struct Material
 {
-    glm::vec3 albedo;        // Base color of the surface
-    glm::vec3 specular;      // Specular reflection color
-    float reflectance;  // How reflective the surface is
-    glm::vec3 emissive;      // Light that the material emits
+    glm::vec3 albedo = glm::vec3(0.0f);      // Base color of the surface
+    glm::vec3 specular = glm::vec3(0.0f);    // Specular reflection color
+    float reflectance = 0.0f;                // How reflective the surface is
+    glm::vec3 emissive = glm::vec3(0.0f);    // Light that the material emits
+
+    bool operator == (const Material& rhs) const
+    {
+        return albedo == rhs.albedo &&
+            specular == rhs.specular &&
+            reflectance == rhs.reflectance &&
+            emissive == rhs.emissive;
+    }
+};
+
+// Index of a material in the MaterialTable
+using MaterialId = uint16_t;
+
+// Every distinct material in the scene, stored once.  Objects only hold a compact index, and the material
+// itself is looked up once the closest hit is known
+struct MaterialTable
+{
+    std::vector<Material> materials;
+
+    // Returns the index of an identical material if we already have one
+    MaterialId Add(const Material& mat)
+    {
+        auto itr = std::find(materials.begin(), materials.end(), mat);
+        if (itr != materials.end())
+        {
+            return MaterialId(itr - materials.begin());
+        }
+        assert(materials.size() < std::numeric_limits<MaterialId>::max());
+        materials.push_back(mat);
+        return MaterialId(materials.size() - 1);
+    }
+
+    const Material& operator[](MaterialId id) const
+    {
+        return materials[id];
+    }
+
+    void Clear()
+    {
+        materials.clear();
+    }
 };
 
 enum class SceneObjectType
@@ -15,22 +56,99 @@ enum class SceneObjectType
     Plane
 };
 
+// Marks a hit record that hasn't hit anything
+const uint32_t NoPrimitive = 0xFFFFFFFF;
+
+// Everything we know about a ray hit before any shading is done.
+// Surface attributes (normal, material) are resolved from it afterwards, and only for the closest hit
+struct HitRecord
+{
+    uint32_t primitiveId = NoPrimitive;                 // Index of the object in the scene
+    float distance = std::numeric_limits<float>::max(); // Distance along the ray
+    uint32_t subPrimitive = 0;                          // For objects built from many pieces, the piece we hit
+    glm::vec2 uv = glm::vec2(0.0f);                 // Barycentrics or surface coordinates within that piece
+};
+
 struct SceneObject
 {
-    // Given a point on the surface, return the material at that point
-    virtual const Material& GetMaterial(const glm::vec3& pos) const = 0;
+    // Given a hit on the surface, return the index of the material at that point
+    virtual MaterialId GetMaterialId(const HitRecord& hit, const glm::vec3& pos) const = 0;
+
+    // Could any of the surface be emissive?  Objects that can't are never shaded as lights
+    virtual bool MayEmit(const MaterialTable& materials) const = 0;
 
     // Is it a sphere or a plane?
     virtual SceneObjectType GetSceneObjectType() const = 0;
 
-    // Given a point on the surface, return a normal
-    virtual glm::vec3 GetSurfaceNormal(const glm::vec3& pos) const = 0;
+    // Given a hit on the surface, return a normal
+    virtual glm::vec3 GetSurfaceNormal(const HitRecord& hit, const glm::vec3& pos) const = 0;
 
     // Given a source position, return a ray to this object's center
     virtual glm::vec3 GetRayFrom(const glm::vec3& from) const = 0;
 
-    // Intersect this object with a ray and figure out if it hits, and return the distance to the hit point 
-    virtual bool Intersects(const glm::vec3& rayOrigin, const glm::vec3& rayDir, float& distance) const = 0;
+    // Intersect this object with a ray and figure out if it hits; fill in the distance to the hit point and
+    // anything needed later to find the surface attributes there.  The primitive ID is left to the caller
+    virtual bool Intersects(const glm::vec3& rayOrigin, const glm::vec3& rayDir, HitRecord& hit) const = 0;
+
+    // Could any of the surface be within distance of pos?  Saying yes when it isn't is allowed, but not the
+    // reverse; short rays leaving pos can skip the objects that say no
+    virtual bool MayBeWithin(const glm::vec3& pos, float distance) const
+    {
+        return true;
+    }
+};
+
+// A hit being shaded.  The normal and material are looked up from the hit record the first time the shader
+// asks for them, so shaders that don't need one never pay for it
+class ShadingPoint
+{
+public:
+    ShadingPoint(const SceneObject* pObj, const HitRecord& h, const glm::vec3& rayOrigin, const glm::vec3& rayDir)
+        : pObject(pObj),
+        hit(h),
+        position(rayOrigin + (rayDir * h.distance))
+    {
+    }
+
+    const HitRecord& GetHit() const
+    {
+        return hit;
+    }
+
+    const glm::vec3& GetPosition() const
+    {
+        return position;
+    }
+
+    const glm::vec3& GetNormal()
+    {
+        if (!hasNormal)
+        {
+            normal = pObject->GetSurfaceNormal(hit, position);
+            hasNormal = true;
+        }
+        return normal;
+    }
+
+    MaterialId GetMaterialId()
+    {
+        if (!hasMaterial)
+        {
+            material = pObject->GetMaterialId(hit, position);
+            hasMaterial = true;
+        }
+        return material;
+    }
+
+private:
+    const SceneObject* pObject;
+    HitRecord hit;
+    glm::vec3 position;
+
+    glm::vec3 normal;
+    MaterialId material = 0;
+    bool hasNormal = false;
+    bool hasMaterial = false;
 };
 
 // A sphere, at a coordinate, with a radius and a material
@@ -38,26 +156,31 @@ struct Sphere : SceneObject
 {
     glm::vec3 center;
     float radius;
-    Material material;
+    MaterialId material;
 
-    Sphere(const Material& mat, const glm::vec3& c, const float r)
+    Sphere(MaterialId mat, const glm::vec3& c, const float r)
     {
         material = mat;
         center = c;
         radius = r;
     }
 
-    virtual const Material& GetMaterial(const glm::vec3& pos) const override
+    virtual MaterialId GetMaterialId(const HitRecord& hit, const glm::vec3& pos) const override
     {
         return material;
     }
 
+    virtual bool MayEmit(const MaterialTable& materials) const override
+    {
+        return materials[material].emissive != glm::vec3(0.0f);
+    }
+
     virtual SceneObjectType GetSceneObjectType() const override
     {
         return SceneObjectType::Sphere;
     }
 
-    virtual glm::vec3 GetSurfaceNormal(const glm::vec3& pos) const
+    virtual glm::vec3 GetSurfaceNormal(const HitRecord& hit, const glm::vec3& pos) const
     {
         return normalize(pos - center);
     }
@@ -67,10 +190,14 @@ struct Sphere : SceneObject
         return normalize(center - from);
     }
 
-    virtual bool Intersects(const glm::vec3& rayOrigin, const glm::vec3& rayDir, float& distance) const
+    virtual bool MayBeWithin(const glm::vec3& pos, float distance) const override
     {
-        bool hit = glm::intersectRaySphere(rayOrigin, glm::normalize(rayDir), center, radius * radius, distance);
-        return hit;
+        return glm::length(pos - center) - radius <= distance;
+    }
+
+    virtual bool Intersects(const glm::vec3& rayOrigin, const glm::vec3& rayDir, HitRecord& hit) const
+    {
+        return glm::intersectRaySphere(rayOrigin, glm::normalize(rayDir), center, radius * radius, hit.distance);
     }
 };
 
@@ -88,23 +215,18 @@ struct Plane : SceneObject
 // A tiled plane.  returns a different material based on the hit point to represent the grid
 struct TiledPlane : Plane
 {
-    Material blackMat;
-    Material whiteMat;
+    MaterialId blackMat;
+    MaterialId whiteMat;
 
-    TiledPlane(const glm::vec3& o, const glm::vec3& n)
+    TiledPlane(MaterialId black, MaterialId white, const glm::vec3& o, const glm::vec3& n)
     {
         normal = n;
         origin = o;
-        blackMat.reflectance = 0.2f;
-        blackMat.specular = glm::vec3(1.0f, 1.0f, 1.0f);
-        blackMat.albedo = glm::vec3(0.0f, 0.0f, 0.0f);
-
-        whiteMat.reflectance = 0.3f;
-        whiteMat.specular = glm::vec3(1.0f, 1.0f, 1.0f);
-        whiteMat.albedo = glm::vec3(1.0f, 1.0f, 1.0f);
+        blackMat = black;
+        whiteMat = white;
     }
 
-    virtual const Material& GetMaterial(const glm::vec3& pos) const override
+    virtual MaterialId GetMaterialId(const HitRecord& hit, const glm::vec3& pos) const override
     {
         bool white = ((int(floor(pos.x / 4) + /*floor(pos.y) +*/ floor(pos.z / 4)) & 1) == 0); 
         if (white)
@@ -113,8 +235,13 @@ struct TiledPlane : Plane
         }
         return blackMat;
     }
+
+    virtual bool MayEmit(const MaterialTable& materials) const override
+    {
+        return materials[blackMat].emissive != glm::vec3(0.0f) || materials[whiteMat].emissive != glm::vec3(0.0f);
+    }
     
-    virtual glm::vec3 GetSurfaceNormal(const glm::vec3& pos) const
+    virtual glm::vec3 GetSurfaceNormal(const HitRecord& hit, const glm::vec3& pos) const
     {
         return normal;
     }
@@ -124,8 +251,13 @@ struct TiledPlane : Plane
         return normalize(origin - from);
     }
     
-    virtual bool Intersects(const glm::vec3& rayOrigin, const glm::vec3& rayDir, float& distance) const override
+    virtual bool MayBeWithin(const glm::vec3& pos, float distance) const override
+    {
+        return std::abs(dot(pos - origin, normal)) <= distance;
+    }
+
+    virtual bool Intersects(const glm::vec3& rayOrigin, const glm::vec3& rayDir, HitRecord& hit) const override
     {
-        return glm::intersectRayPlane(rayOrigin, rayDir, origin, normal, distance);
+        return glm::intersectRayPlane(rayOrigin, rayDir, origin, normal, hit.distance);
     }
 };
\ No newline at end of file